@@ -33,7 +33,6 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <err.h>
-#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -235,8 +234,6 @@ void bell_setFreq(const int value)
 
 void bell_execute(TVterm *p)
 {
-	sigset_t set, oldset;
-
 	assert(initialized);
 	assert(p != NULL);
 
@@ -252,22 +249,20 @@ void bell_execute(TVterm *p)
 		}
 		break;
 	case BELL_STYLE_VISIBLE:
-		sigemptyset(&set);
-		sigaddset(&set, SIGUSR1);
-		sigprocmask(SIG_SETMASK, &set, &oldset);
+		framebuffer_lock();
 		if (p->active) {
 			gFramebuffer.accessor.reverse(&gFramebuffer,
 						      0, 0,
-						      gFramebuffer.width,
-						      gFramebuffer.height,
+						      gFramebuffer.screenWidth,
+						      gFramebuffer.screenHeight,
 						      bell.color);
 			gFramebuffer.accessor.reverse(&gFramebuffer,
 						      0, 0,
-						      gFramebuffer.width,
-						      gFramebuffer.height,
+						      gFramebuffer.screenWidth,
+						      gFramebuffer.screenHeight,
 						      bell.color);
 		}
-		sigprocmask(SIG_SETMASK, &oldset, NULL);
+		framebuffer_unlock();
 		break;
 	default:
 		break;
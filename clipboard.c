@@ -37,11 +37,16 @@
 
 #include "clipboard.h"
 
+#define CLIPBOARD_MIN_SIZE (256)
+
+/* length counts the terminating NUL; size is what text has room for */
 static struct {
 	char *text;
 	size_t length;
+	size_t size;
 } clipboard = {
 	NULL,
+	0,
 	0
 };
 
@@ -57,7 +62,8 @@ void clipboard_initialize(void)
 	atexit(finalizer);
 	initialized = true;
 	clipboard.length = 1;
-	clipboard.text = malloc(clipboard.length);
+	clipboard.size = CLIPBOARD_MIN_SIZE;
+	clipboard.text = malloc(clipboard.size);
 	if (clipboard.text == NULL)
 		err(1, "malloc()");
 	clipboard.text[clipboard.length - 1] = '\0';
@@ -72,6 +78,7 @@ static void finalize(void)
 		clipboard.text = NULL;
 	}
 	clipboard.length = 0;
+	clipboard.size = 0;
 	initialized = false;
 }
 
@@ -84,26 +91,27 @@ void clipboard_clear(void)
 {
 	assert(initialized);
 
-	if (clipboard.text != NULL)
-		free(clipboard.text);
 	clipboard.length = 1;
-	clipboard.text = malloc(clipboard.length);
-	if (clipboard.text == NULL)
-		err(1, "malloc()");
 	clipboard.text[clipboard.length - 1] = '\0';
 }
 
 void clipboard_appendText(const char *text, const size_t length)
 {
-	int newlength;
+	size_t newlength, newsize;
 
 	assert(initialized);
 
 	if (text != NULL && length > 0) {
 		newlength = clipboard.length + length;
-		clipboard.text = realloc(clipboard.text, newlength);
-		if (clipboard.text == NULL)
-			err(1, "realloc()");
+		if (newlength > clipboard.size) {
+			for (newsize = clipboard.size * 2; newsize < newlength;
+			     newsize *= 2)
+				;
+			clipboard.text = realloc(clipboard.text, newsize);
+			if (clipboard.text == NULL)
+				err(1, "realloc()");
+			clipboard.size = newsize;
+		}
 		memcpy(clipboard.text + clipboard.length - 1, text, length);
 		clipboard.length = newlength;
 		clipboard.text[clipboard.length - 1] = '\0';
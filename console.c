@@ -33,7 +33,6 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <err.h>
-#include <errno.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -85,7 +84,7 @@ static struct {
 
 void console_initialize(void)
 {
-	struct sigaction act_sigusr1, act_sigusr2;
+	sigset_t set;
 	struct vt_mode vt_mode;
 
 	assert(!initialized);
@@ -129,21 +128,17 @@ void console_initialize(void)
 
 	ioctl(STDIN_FILENO, VT_RELDISP, VT_ACKACQ);
 
-	bzero(&act_sigusr1, sizeof(act_sigusr1));
-	act_sigusr1.sa_handler = release;
-	act_sigusr1.sa_flags = SA_RESTART;
-	sigaction(SIGUSR1, &act_sigusr1, NULL);
-
-	bzero(&act_sigusr2, sizeof(act_sigusr2));
-	act_sigusr2.sa_handler = acquire;
-	act_sigusr2.sa_flags = SA_RESTART;
-	sigaction(SIGUSR2, &act_sigusr2, NULL);
+	/* held until the event loop reads them; see console_handleSignal() */
+	sigemptyset(&set);
+	sigaddset(&set, CONSOLE_RELEASE_SIGNAL);
+	sigaddset(&set, CONSOLE_ACQUIRE_SIGNAL);
+	sigprocmask(SIG_BLOCK, &set, NULL);
 
 	vt_mode.mode   = VT_PROCESS;
 	vt_mode.waitv  = 0;
-	vt_mode.relsig = SIGUSR1;
-	vt_mode.acqsig = SIGUSR2;
-	vt_mode.frsig  = SIGUSR1;
+	vt_mode.relsig = CONSOLE_RELEASE_SIGNAL;
+	vt_mode.acqsig = CONSOLE_ACQUIRE_SIGNAL;
+	vt_mode.frsig  = CONSOLE_RELEASE_SIGNAL;
 	if (ioctl(STDIN_FILENO, VT_SETMODE, &vt_mode) == -1)
 		warn("ioctl(VT_SETMODE)");
 #if defined (__linux__)
@@ -153,18 +148,9 @@ void console_initialize(void)
 
 static void finalize(void)
 {
-	struct sigaction act_sigusr1, act_sigusr2;
-
 	assert(initialized);
 
-	bzero(&act_sigusr1, sizeof(act_sigusr1));
-	act_sigusr1.sa_handler = SIG_DFL;
-	sigaction(SIGUSR1, &act_sigusr1, NULL);
-
-	bzero(&act_sigusr2, sizeof(act_sigusr2));
-	act_sigusr2.sa_handler = SIG_DFL;
-	sigaction(SIGUSR2, &act_sigusr2, NULL);
-
+	/* VT signals stay blocked: a late one must not kill us on exit. */
 	ioctl(STDIN_FILENO, VT_RELDISP, 1); /* VT_TRUE */
 
 	if (console.termios != NULL) {
@@ -305,30 +291,36 @@ void console_setReleaseHandler(void (*releaseHandler)(int signum))
 	console.releaseHandler = releaseHandler;
 }
 
-static void acquire(int signum)
+/*
+ * Called from the event loop with a signal read from the signal
+ * descriptor, so handlers run between draws, never inside one.
+ */
+void console_handleSignal(int signum)
 {
-	int errsv;
+	assert(initialized);
+
+	if (signum == CONSOLE_RELEASE_SIGNAL)
+		release(signum);
+	else if (signum == CONSOLE_ACQUIRE_SIGNAL)
+		acquire(signum);
+}
 
+static void acquire(int signum)
+{
 	assert(initialized);
 
-	errsv = errno;
 	ioctl(STDIN_FILENO, VT_RELDISP, VT_ACKACQ);
 	ioctl(STDIN_FILENO, VT_WAITACTIVE, console.active);
 	if (console.acquireHandler != NULL)
 		console.acquireHandler(signum);
-	errno = errsv;
 }
 
 static void release(int signum)
 {
-	int errsv;
-
 	assert(initialized);
 
-	errsv = errno;
 	if (console.releaseHandler != NULL)
 		console.releaseHandler(signum);
 	ioctl(STDIN_FILENO, VT_RELDISP, 1); /* 1 == VT_TRUE */
-	errno = errsv;
 }
 
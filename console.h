@@ -28,9 +28,14 @@
 #ifndef INCLUDE_CONSOLE_H
 #define INCLUDE_CONSOLE_H
 
+#include <signal.h>
 #include <termios.h>
 #include <stdbool.h>
 
+/* VT_PROCESS signals; blocked and read by the terminal's event loop */
+#define CONSOLE_RELEASE_SIGNAL SIGUSR1
+#define CONSOLE_ACQUIRE_SIGNAL SIGUSR2
+
 void console_initialize(void);
 int console_getActive(void);
 bool console_isActive(void);
@@ -41,6 +46,7 @@ void console_setSC_PIXEL_MODE(bool SC_PIXEL_MODE);
 #endif
 void console_setAcquireHandler(void (*acquireHandler)(int signum));
 void console_setReleaseHandler(void (*releaseHandler)(int signum));
+void console_handleSignal(int signum);
 
 #endif /* INCLUDE_CONSOLE_H */
 
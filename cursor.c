@@ -32,7 +32,6 @@
 #include <sys/time.h>
 #include <assert.h>
 #include <err.h>
-#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,6 +54,7 @@ static void configCursorType(TCursor *c, const char *config);
 static void configCursorInterval(TCursor *c, const char *config);
 static void configCursorColor(TCursor *c, const char *config);
 static void configCursorHeight(TCursor *c, const char *config);
+static void clearCell(TCursorCell *cell);
 static void draw(TVterm *p, TCursor *c);
 
 void cursor_initialize(void)
@@ -72,7 +72,6 @@ void cursor_initialize(void)
 	cursor.mouse = false;
 	cursor.shown = false;
 	cursor.wide = false;
-	cursor.width = gFontsWidth;
 	cursor.height = gFontsHeight;
 	cursor.interval = DEFAULT_CURSOR_INTERVAL;
 	cursor.color = palette_ansiToVGA(DEFAULT_CURSOR_COLOR);
@@ -86,11 +85,21 @@ void cursor_initialize(void)
 	mouseCursor.mouse = true;
 	mouseCursor.shown = false;
 	mouseCursor.wide = false;
-	mouseCursor.width = gFontsWidth;
 	mouseCursor.height = gFontsHeight;
 	mouseCursor.interval = DEFAULT_CURSOR_INTERVAL;
 	mouseCursor.color = palette_ansiToVGA(DEFAULT_CURSOR_COLOR);
 	cursor_resetTimer(&mouseCursor);
+	clearCell(&(cursor.under));
+	clearCell(&(mouseCursor.under));
+}
+
+static void clearCell(TCursorCell *cell)
+{
+	cell->font = &(gFonts[0]);
+	cell->code = 0x00;
+	cell->foreground = 0;
+	cell->background = 0;
+	cell->underline = false;
 }
 
 static void finalize(void)
@@ -238,6 +247,24 @@ bool cursor_isTimeout(TCursor *c)
 	return elapsedTime >= c->interval;
 }
 
+/* msec. until cursor_isTimeout() becomes true */
+int cursor_getTimeout(TCursor *c)
+{
+	struct timeval now, diff;
+	long elapsedTime;
+
+	assert(initialized);
+	assert(c != NULL);
+
+	timerclear(&diff);
+	gettimeofday(&now, NULL);
+	timersub(&now, &(c->timer), &diff);
+	elapsedTime = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	if (elapsedTime >= (long)c->interval * 100)
+		return 0;
+	return c->interval * 100 - elapsedTime;
+}
+
 void cursor_toggle(TVterm *p, TCursor *c)
 {
 	assert(initialized);
@@ -249,29 +276,29 @@ void cursor_toggle(TVterm *p, TCursor *c)
 	cursor_resetTimer(c);
 }
 
+/*
+ * Draw the cell under the cursor, with the cursor if it is shown.  The
+ * framebuffer is only written, so a cursor drawn over is simply redrawn.
+ */
 static void draw(TVterm *p, TCursor *c)
 {
-	sigset_t set, oldset;
-	int x, y, height, width;
+	TCursorCell *u;
 
 	assert(initialized);
 	assert(p != NULL);
 	assert(c != NULL);
 
-	sigemptyset(&set);
-	sigaddset(&set, SIGUSR1);
-	sigprocmask(SIG_SETMASK, &set, &oldset);
 	if (p->active) {
-		x = gFontsWidth * c->x;
-		y = gFontsHeight * c->y + (gFontsHeight - c->height);
-		width = c->width + (c->wide ? c->width : 0);
-		height = c->height;
-		gFramebuffer.accessor.reverse(&gFramebuffer,
-					      x, y,
-					      width, height,
-					      c->color);
+		u = &(c->under);
+		if (c->shown)
+			font_drawCursor(u->font, u->code, c->color,
+					u->background, c->x, c->y,
+					u->underline, c->wide, c->height);
+		else
+			font_draw(u->font, u->code, u->foreground,
+				  u->background, c->x, c->y,
+				  u->underline, c->wide);
 	}
-	sigprocmask(SIG_SETMASK, &oldset, NULL);
 }
 
 void cursor_show(TVterm *p, TCursor *c, const bool show)
@@ -283,15 +310,15 @@ void cursor_show(TVterm *p, TCursor *c, const bool show)
 	assert(c != NULL);
 
 	shown = show;
-	if (!p->active)
-		return;
 	if (!c->on)
 		shown = false;
 	if (!c->mouse && (keyboard_isScrollLocked() || p->top != 0))
 		shown = false;
-	if (c->shown != shown) {
-		draw(p, c);
+	framebuffer_lock();
+	if (p->active && c->shown != shown) {
 		c->shown = shown;
+		draw(p, c);
 	}
+	framebuffer_unlock();
 }
 
@@ -33,6 +33,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "font.h"
 #include "getcap.h"
 #include "vterm.h"
 
@@ -44,6 +45,15 @@ typedef enum {
 	CURSOR_STYLE_BLINK
 } CURSOR_STYLE;
 
+/* the cell under a cursor, as it is on the screen */
+typedef struct Raw_TCursorCell {
+	TFont *font;
+	uint16_t code;
+	uint8_t foreground;
+	uint8_t background;
+	bool underline;
+} TCursorCell;
+
 typedef struct Raw_TCursor {
 	CURSOR_STYLE style;
 	u_int x;
@@ -53,11 +63,11 @@ typedef struct Raw_TCursor {
 	bool mouse;
 	bool shown;
 	bool wide;
-	u_short width;
 	u_short height;
 	u_int interval;
 	uint8_t color;
 	struct timeval timer;
+	TCursorCell under;    /* redrawn to hide the cursor */
 } TCursor;
 
 extern TCursor cursor;
@@ -67,6 +77,7 @@ void cursor_initialize(void);
 void cursor_configure(TCaps *caps);
 void cursor_resetTimer(TCursor *c);
 bool cursor_isTimeout(TCursor *c);
+int cursor_getTimeout(TCursor *c);
 void cursor_toggle(TVterm *p, TCursor *c);
 void cursor_show(TVterm *p, TCursor *c, const bool show);
 
@@ -33,6 +33,7 @@
 #include "config.h"
 #endif
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -40,6 +41,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pwd.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -47,6 +49,12 @@
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "csv.h"
 #include "eastasianwidth.h"
@@ -62,6 +70,8 @@ u_short gFontsWidth = 0;
 u_short gFontsHeight = 0;
 
 #define DEFAULT_FONT_SHADOW_COLOR (0) /* Black */
+#define DEFAULT_FONT_SCALE        (1)
+#define MAX_FONT_SCALE            (3)
 
 typedef enum {
 	FONT_EFFECT_OFF,
@@ -71,28 +81,165 @@ typedef enum {
 static struct {
 	FONT_EFFECT effect;
 	uint8_t shadowColor;
+	char *cache;
+	u_int scale;
 } font = {
 	FONT_EFFECT_OFF,
-	DEFAULT_FONT_SHADOW_COLOR
+	DEFAULT_FONT_SHADOW_COLOR,
+	NULL,
+	DEFAULT_FONT_SCALE
+};
+
+/*
+ * Font cache file.  A cache holds a font exactly as getStandardGlyph()
+ * uses it, so that it can be mapped and used without parsing the PCF.
+ * It is only valid on the machine which wrote it (native byte order).
+ *
+ *   header
+ *   path           source font path (padded to 4 bytes)
+ *   glyphs         uint32_t glyph offset of each glyph
+ *   widths         8 bit width indexes (if hasWidths, padded)
+ *   variants       struct fontCacheVariant (unifont only)
+ *   bitmap         glyph bitmaps (padded by bytesPerChar)
+ *   extra          the default glyph and unifont variants
+ */
+#define FONT_CACHE_MAGIC   "JFBTFNT"
+#define FONT_CACHE_VERSION (4)
+#define FONT_CACHE_ALIGN(x) (((x) + 3) & ~(size_t)3)
+
+struct fontCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t checksum;      /* FNV-1a of everything after the header */
+	int64_t sourceSize;
+	int64_t sourceMtime;
+	uint32_t pathLength;
+	uint32_t unifont;
+	uint32_t scale;
+	uint16_t width;
+	uint16_t height;
+	uint16_t bytesPerWidth;
+	uint16_t bytesPerChar;
+	uint32_t colf;
+	uint32_t coll;
+	uint32_t rowf;
+	uint32_t rowl;
+	uint32_t glyphs;
+	uint32_t hasWidths;
+	uint16_t widths[FONT_WIDTHS];
+	uint32_t nWidths;
+	uint32_t variants;
+	uint32_t bitmapSize;
+	uint32_t extraSize;
+};
+
+struct fontCacheVariant {
+	uint16_t ucs2;
+	uint16_t ambiguous;
+	uint16_t halfWidthGlyphWidth;
+	uint16_t fullWidthGlyphWidth;
+	uint32_t halfWidthGlyph;
+	uint32_t fullWidthGlyph;
+};
+
+struct fontCacheLayout {
+	size_t path;
+	size_t glyphs;
+	size_t widths;
+	size_t variants;
+	size_t bitmap;
+	size_t extra;
+	size_t total;
+};
+
+/*
+ * Designation table indexed by [double byte][96 char][final byte].
+ * Final bytes of ISO 2022 designations are in 0x30-0x7e.
+ */
+#define DESIGNATION_FINAL_MIN (0x30)
+#define DESIGNATION_FINAL_MAX (0x7e)
+#define DESIGNATION_FINALS    (DESIGNATION_FINAL_MAX - DESIGNATION_FINAL_MIN + 1)
+
+static short designation[2][2][DESIGNATION_FINALS];
+static bool designationReady;
+
+/* a fontset entry to be loaded at startup */
+struct fontsetEntry {
+	TFont *dst;
+	TFont *src;             /* alias source */
+	char *path;             /* pcf path */
+	FONT_HALF half;
+	bool active;            /* not replaced by a later entry */
+	bool loaded;
+};
+
+#ifdef HAVE_LIBPTHREAD
+#define FONT_LOADERS (8)
+
+struct fontsetQueue {
+	pthread_mutex_t lock;
+	struct fontsetEntry *entries;
+	int count;
+	int next;
+};
+#endif
+
+/*
+ * Fallback glyphs by [double byte font][code page].  A page is built
+ * whole on first use and kept until finalize(), so a returned glyph is
+ * never rewritten under its user.
+ */
+#define FALLBACK_GLYPH_SIZE (PICOFONT_HEIGHT * 2)
+#define FALLBACK_PAGE_SHIFT (8)
+#define FALLBACK_PAGE       (1 << FALLBACK_PAGE_SHIFT)
+
+static u_char *fallbackGlyphs[2][0x10000 >> FALLBACK_PAGE_SHIFT];
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t fallbackGlyphsLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Glyphs turned for video.rotate, by glyph address and drawn size.  A
+ * glyph is rotated on its first draw; the cache is flushed whenever glyph
+ * memory may be freed or moved.
+ */
+#define ROTATED_GLYPH_BUCKETS (4096)
+
+struct rotatedGlyph {
+	struct rotatedGlyph *next;
+	const u_char *glyph;
+	u_short width;
+	u_short height;
+	u_short bytesPerWidth;
+	u_char bitmap[];
 };
 
+static struct rotatedGlyph *rotatedGlyphs[ROTATED_GLYPH_BUCKETS];
+
 static bool initialized;
 static pid_t child;
+static uint32_t emptyGlyphPage[FONT_GLYPH_PAGE];
 
 #ifdef ENABLE_UTF8
+/* variants are in extra after the default glyph, so never at offset 0 */
+#define UNIFONT_GLYPH_NONE (0)
+
 struct unifontGlyphList {
 	uint16_t ucs2;
-	u_char *glyph;
+	bool saved;
+	uint32_t glyph;
 	u_short glyphWidth;
 	bool ambiguous;
-	u_char *halfWidthGlyph;
+	uint32_t halfWidthGlyph;
 	u_short halfWidthGlyphWidth;
-	u_char *fullWidthGlyph;
+	uint32_t fullWidthGlyph;
 	u_short fullWidthGlyphWidth;
 	struct unifontGlyphList *next;
 };
 
 struct unifontGlyphList *unifontGlyphList = NULL;
+static struct unifontGlyphList *unifontGlyphListTail = NULL;
+static bool unifontGlyphListInCache = false;
 #endif
 
 static struct {
@@ -104,15 +251,61 @@ static struct {
 static void finalize(void);
 static void finalizer(void);
 static void configFontset(TCapValue *capValue);
+static void loadFontsets(struct fontsetEntry *entries, int count);
+#ifdef HAVE_LIBPTHREAD
+static void *fontsetLoader(void *arg);
+#endif
 static void configEffect(const char *config);
 static void configShadowColor(const char *config);
+static void configCache(const char *config);
+static void configScale(const char *config);
+static void createDesignationTable(void);
 static TFont *getFontByName(const char *name);
 static int codeToIndex(TFont *p, uint16_t code);
+static void createFallbackGlyph(u_char *glyph, uint16_t code, bool wide);
+static u_char *createFallbackPage(uint16_t first, bool wide);
 static const u_char *getDefaultGlyph(TFont *p, uint16_t code, u_short *width);
 static const u_char *getStandardGlyph(TFont *p, uint16_t code, u_short *width);
+static const u_char *getPendingGlyph(TFont *p, uint16_t code, u_short *width);
+static u_int getGlyphCount(TFont *p);
+static uint32_t getGlyphOffset(TFont *p, u_int index);
+static const u_char *getGlyphAddress(TFont *p, uint32_t offset);
+static u_short getGlyphWidth(TFont *p, u_int index);
+static u_int getWidthIndex(TFont *p, u_short width);
+static void allocateGlyphWidths(TFont *p);
+static void setGlyphOffset(TFont *p, u_int index, uint32_t offset);
+static void setGlyphWidth(TFont *p, u_int index, u_short width);
+static void updateSharedGlyphs(TFont *p);
+static void freeGlyphs(TFont *p);
 static void childHandler(int signum);
+static bool isCompressed(const char *path);
+static bool isStreamed(const char *path);
 static FILE *openStream(const char *path);
+static u_char *mapImage(const char *path, size_t *size);
+#ifdef HAVE_LIBZ
+static u_char *inflateImage(const char *path, size_t *size);
+#endif
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length);
+static char *getFontCachePath(const char *path, bool unifont,
+			      const char *suffix);
+static void getFontCacheLayout(const struct fontCacheHeader *header,
+			       struct fontCacheLayout *layout);
+static bool isValidCacheOffset(const struct fontCacheHeader *header,
+			       uint32_t offset, size_t size);
+static bool isTrustedCache(const struct stat *st);
+static bool isTrustedCacheDirectory(void);
+static bool loadFontCache(TFont *p, const char *path,
+			  const struct stat *source, bool unifont);
+static bool isReadOnlyError(int error);
+static void saveFontCache(TFont *p, bool unifont);
+static int compareOffset(const void *a, const void *b);
+static void scaleGlyph(TFont *p, const u_char *glyph, size_t size,
+		       u_char *scaled);
+static void scaleFont(TFont *p);
 static void setPCFFont(TFont *p, const char *path, FONT_HALF half);
+static void setPendingFont(TFont *p, const char *path, FONT_HALF half);
+static void loadPendingFont(TFont *p);
+static bool isPreloadFont(TFont *p);
 static void setFontAlias(TFont *dst, TFont *src, FONT_HALF half);
 static void setFontsSize(void);
 #ifdef ENABLE_UTF8
@@ -121,35 +314,54 @@ static bool isHalfWidth(uint16_t ucs2);
 static bool isAmbiguous(uint16_t ucs2);
 static void unifontGlyphList_initialize(void);
 static void unifontGlyphList_add(uint16_t ucs2, bool ambiguous,
-				 u_char *halfWidthGlyph,
+				 uint32_t halfWidthGlyph,
 				 u_short halfWidthGlyphWidth,
-				 u_char *fullWidthGlyph,
+				 uint32_t fullWidthGlyph,
 				 u_short fullWidthGlyphWidth);
 static void unifontGlyphList_finalize(void);
 static u_char *createFullWidthGlyph(TFont *p, uint16_t ucs2,
 				    u_short *glyphWidth);
 static u_char *createHalfWidthGlyph(TFont *p, uint16_t ucs2,
 				    u_short *glyphWidth);
+static uint32_t appendExtraGlyph(TFont *p, const u_char *glyph,
+				 size_t size, u_short glyphWidth);
 static void createUnifontGlyph(TFont *p);
 static void saveUnifontGlyph(TFont *p);
 static void restoreUnifontGlyph(TFont *p);
+static void setUnifontGlyph(TFont *p, int ambiguousWidth);
 #endif
 static void underlineGlyph_initialize(void);
 static void createUnderlineGlyph(void);
 static void underlineGlyph_finalize(void);
+static const u_char *getRotatedGlyph(const u_char *glyph,
+				     u_int bytesPerWidth, u_int width,
+				     u_int height, u_int *rotatedBytesPerWidth);
+static void flushRotatedGlyphs(void);
+static void overlayRows(const u_char *glyph, u_int bytesPerWidth,
+			u_int x, u_int y, u_int width, u_int height,
+			u_int top, uint8_t color);
 
 #define FMACRO_94__FONT(final, align, fontname) { \
 		.getGlyph = getDefaultGlyph, \
 		.name = fontname, \
+		.path = NULL, \
 		.width = 1, \
 		.height = 1, \
 		.signature = FONT_SIGNATURE_SINGLE | FONT_SIGNATURE_94CHAR | final, \
 		.half = align,	\
 		.alias = false, \
-		.glyphs = NULL, \
+		.aliasOf = NULL, \
+		.glyphPages = NULL, \
 		.glyphWidths = NULL, \
-		.defaultGlyph = NULL, \
+		.widths = { 0 }, \
+		.nWidths = 0, \
+		.extra = NULL, \
+		.extraSize = 0, \
 		.bitmap = NULL,	\
+		.bitmapSize = 0, \
+		.image = NULL, \
+		.imageSize = 0, \
+		.imageMapped = false, \
 		.colf = 0xff, \
 		.coll = 0x00, \
 		.rowf = 0xff, \
@@ -161,15 +373,24 @@ static void underlineGlyph_finalize(void);
 #define FMACRO_96__FONT(final, align, fontname) { \
 		.getGlyph = getDefaultGlyph, \
 		.name = fontname, \
+		.path = NULL, \
 		.width = 1, \
 		.height = 1, \
 		.signature = FONT_SIGNATURE_SINGLE | FONT_SIGNATURE_96CHAR | final, \
 		.half = align,	\
 		.alias = false, \
-		.glyphs = NULL, \
+		.aliasOf = NULL, \
+		.glyphPages = NULL, \
 		.glyphWidths = NULL, \
-		.defaultGlyph = NULL, \
+		.widths = { 0 }, \
+		.nWidths = 0, \
+		.extra = NULL, \
+		.extraSize = 0, \
 		.bitmap = NULL,	\
+		.bitmapSize = 0, \
+		.image = NULL, \
+		.imageSize = 0, \
+		.imageMapped = false, \
 		.colf = 0xff, \
 		.coll = 0x00, \
 		.rowf = 0xff, \
@@ -181,15 +402,24 @@ static void underlineGlyph_finalize(void);
 #define FMACRO_94N_FONT(final, align, fontname) { \
 		.getGlyph = getDefaultGlyph, \
 		.name = fontname, \
+		.path = NULL, \
 		.width = 2, \
 		.height = 1, \
 		.signature = FONT_SIGNATURE_DOUBLE | FONT_SIGNATURE_94CHAR | final, \
 		.half = align,	\
 		.alias = false, \
-		.glyphs = NULL, \
+		.aliasOf = NULL, \
+		.glyphPages = NULL, \
 		.glyphWidths = NULL, \
-		.defaultGlyph = NULL,	\
+		.widths = { 0 }, \
+		.nWidths = 0, \
+		.extra = NULL, \
+		.extraSize = 0, \
 		.bitmap = NULL,	\
+		.bitmapSize = 0, \
+		.image = NULL, \
+		.imageSize = 0, \
+		.imageMapped = false, \
 		.colf = 0xff, \
 		.coll = 0x00, \
 		.rowf = 0xff, \
@@ -301,15 +531,24 @@ TFont gFonts[] = {
 	{
 		.getGlyph = getDefaultGlyph,
 		.name = "iso10646.1",
+		.path = NULL,
 		.width = 1,
 		.height = 1,
 		.signature = FONT_SIGNATURE_OTHER,
 		.half = FONT_HALF_UNI,
 		.alias = false,
-		.glyphs = NULL,
+		.aliasOf = NULL,
+		.glyphPages = NULL,
 		.glyphWidths = NULL,
-		.defaultGlyph = NULL,
+		.widths = { 0 },
+		.nWidths = 0,
+		.extra = NULL,
+		.extraSize = 0,
 		.bitmap = NULL,
+		.bitmapSize = 0,
+		.image = NULL,
+		.imageSize = 0,
+		.imageMapped = false,
 		.colf = 0xff,
 		.coll = 0x00,
 		.rowf = 0xff,
@@ -322,15 +561,24 @@ TFont gFonts[] = {
 	{
 		.getGlyph = getDefaultGlyph,
 		.name = NULL,
+		.path = NULL,
 		.width = 0,
 		.height = 0,
 		.signature = 0x00000000,
 		.half = FONT_HALF_LEFT,
 		.alias = false,
-		.glyphs = NULL,
+		.aliasOf = NULL,
+		.glyphPages = NULL,
 		.glyphWidths = NULL,
-		.defaultGlyph = NULL,
+		.widths = { 0 },
+		.nWidths = 0,
+		.extra = NULL,
+		.extraSize = 0,
 		.bitmap = NULL,
+		.bitmapSize = 0,
+		.image = NULL,
+		.imageSize = 0,
+		.imageMapped = false,
 		.colf = 0x00,
 		.coll = 0x00,
 		.rowf = 0x00,
@@ -343,9 +591,13 @@ TFont gFonts[] = {
 
 void font_initialize(void)
 {
+	int i;
+
 	assert(!initialized);
 
 	atexit(finalizer);
+	for (i = 0; i < FONT_GLYPH_PAGE; i++)
+		emptyGlyphPage[i] = FONT_GLYPH_DEFAULT;
 #ifdef ENABLE_UTF8
 	unifontGlyphList_initialize();
 #endif
@@ -356,27 +608,28 @@ void font_initialize(void)
 static void finalize(void)
 {
 	TFont *p;
+	int i, n;
 
 	assert(initialized);
 
 	for (p = gFonts; p->name != NULL; p++) {
 		if (!p->alias && font_isLoaded(p)) {
 			p->getGlyph = getDefaultGlyph;
-			if (p->glyphs != NULL) {
-				free(p->glyphs);
-				p->glyphs = NULL;
-			}
-			if (p->glyphWidths != NULL) {
-				free(p->glyphWidths);
-				p->glyphWidths = NULL;
-			}
-			if (p->defaultGlyph != NULL) {
-				free(p->defaultGlyph);
-				p->defaultGlyph = NULL;
-			}
-			if (p->bitmap != NULL) {
+			freeGlyphs(p);
+			if (p->image != NULL) {
+				if (p->imageMapped)
+					munmap(p->image, p->imageSize);
+				else
+					free(p->image);
+				p->image = NULL;
+				p->imageSize = 0;
+			} else if (p->bitmap != NULL)
 				free(p->bitmap);
-				p->bitmap = NULL;
+			p->bitmap = NULL;
+			p->bitmapSize = 0;
+			if (p->path != NULL) {
+				free(p->path);
+				p->path = NULL;
 			}
 		}
 	}
@@ -384,6 +637,20 @@ static void finalize(void)
 	unifontGlyphList_finalize();
 #endif
 	underlineGlyph_finalize();
+	flushRotatedGlyphs();
+	for (i = 0; i < 2; i++) {
+		for (n = 0; n < (0x10000 >> FALLBACK_PAGE_SHIFT); n++) {
+			if (fallbackGlyphs[i][n] != NULL) {
+				free(fallbackGlyphs[i][n]);
+				fallbackGlyphs[i][n] = NULL;
+			}
+		}
+	}
+	if (font.cache != NULL) {
+		free(font.cache);
+		font.cache = NULL;
+	}
+	designationReady = false;
 	initialized = false;
 }
 
@@ -396,15 +663,24 @@ static void configFontset(TCapValue *capValue)
 {
 	struct sigaction act, oldact;
 	const char *name, *type, *side, *path;
+	struct fontsetEntry *entries, *e;
 	TFont *dst, *src;
 	TCapValue *p;
 	TCsv csv;
 	FONT_HALF half;
-	int i;
+	int i, n;
 
 	assert(initialized);
 	assert(capValue != NULL);
 
+	n = 0;
+	for (p = capValue; p != NULL; p = p->next)
+		n++;
+	entries = calloc(n, sizeof(struct fontsetEntry));
+	if (entries == NULL)
+		err(1, "calloc()");
+	n = 0;
+
 	bzero(&act, sizeof(act));
 	act.sa_handler = childHandler;
 	act.sa_flags = SA_NOCLDSTOP | SA_RESTART;
@@ -450,7 +726,7 @@ static void configFontset(TCapValue *capValue)
 		i = lookup(true, type, "pcf", "alias", (char *)NULL);
 		switch (i) {
 		case 0:
-			setPCFFont(dst, path, half);
+			src = NULL;
 			break;
 		case 1:
 			if ((src = getFontByName(path)) == NULL) {
@@ -458,16 +734,49 @@ static void configFontset(TCapValue *capValue)
 				csv_finalize(&csv);
 				continue;
 			}
-			setFontAlias(dst, src, half);
 			break;
 		default:
 			warnx("FONT : Skipped (BAD FORMAT)");
 			csv_finalize(&csv);
 			continue;
 		}
+		/* a later entry for the same fontset wins */
+		for (e = entries; e < entries + n; e++)
+			if (e->dst == dst)
+				e->active = false;
+		/* nothing may fork once other threads run */
+		if (src == NULL && !isPreloadFont(dst) && !isStreamed(path)) {
+			setPendingFont(dst, path, half);
+			csv_finalize(&csv);
+			continue;
+		}
+		e = &(entries[n++]);
+		e->dst = dst;
+		e->src = src;
+		e->path = NULL;
+		if (src == NULL) {
+			e->path = strdup(path);
+			if (e->path == NULL)
+				err(1, "strdup()");
+		}
+		e->half = half;
+		e->active = true;
+		e->loaded = false;
 		csv_finalize(&csv);
 	}
 
+	/* aliases resolve once their sources are loaded */
+	loadFontsets(entries, n);
+	for (e = entries; e < entries + n; e++) {
+		if (e->active && e->src != NULL) {
+			setFontAlias(e->dst, e->src, e->half);
+			if (isPreloadFont(e->dst))
+				loadPendingFont(e->dst);
+		}
+		if (e->path != NULL)
+			free(e->path);
+	}
+	free(entries);
 	sigaction(SIGCHLD, &oldact, NULL);
 #ifdef ENABLE_UTF8
 	if (!font_isLoaded(&(gFonts[0]))) {
@@ -486,6 +795,99 @@ static void configFontset(TCapValue *capValue)
 	createUnderlineGlyph();
 }
 
+/*
+ * Load the pcf entries.  Fonts which need a gunzip child are loaded
+ * here first; the rest are shared between this thread and workers.
+ * Every entry writes only its own TFont, so the result does not depend
+ * on the order in which they finish.
+ */
+static void loadFontsets(struct fontsetEntry *entries, int count)
+{
+	struct fontsetEntry *e;
+#ifdef HAVE_LIBPTHREAD
+	struct fontsetQueue queue;
+	pthread_t threads[FONT_LOADERS];
+	sigset_t set, oldset;
+	long cpus;
+	int i, jobs, workers;
+#endif
+
+	assert(initialized);
+	assert(entries != NULL || count == 0);
+
+	for (e = entries; e < entries + count; e++) {
+		if (e->active && e->path != NULL && isStreamed(e->path)) {
+			setPCFFont(e->dst, e->path, e->half);
+			e->loaded = true;
+		}
+	}
+#ifdef HAVE_LIBPTHREAD
+	jobs = 0;
+	for (e = entries; e < entries + count; e++)
+		if (e->active && e->path != NULL && !e->loaded)
+			jobs++;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = jobs;
+	if (workers > cpus)
+		workers = cpus;
+	if (workers > FONT_LOADERS)
+		workers = FONT_LOADERS;
+	workers--; /* this thread loads too */
+	pthread_mutex_init(&(queue.lock), NULL);
+	queue.entries = entries;
+	queue.count = count;
+	queue.next = 0;
+	/* signals are left to this thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	for (i = 0; i < workers; i++)
+		if (pthread_create(&(threads[i]), NULL,
+				   fontsetLoader, &queue) != 0)
+			break;
+	workers = i;
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	fontsetLoader(&queue);
+	for (i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&(queue.lock));
+#else
+	for (e = entries; e < entries + count; e++) {
+		if (e->active && e->path != NULL && !e->loaded) {
+			setPCFFont(e->dst, e->path, e->half);
+			e->loaded = true;
+		}
+	}
+#endif
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *fontsetLoader(void *arg)
+{
+	struct fontsetQueue *queue;
+	struct fontsetEntry *e;
+
+	assert(arg != NULL);
+
+	queue = arg;
+	for (;;) {
+		pthread_mutex_lock(&(queue->lock));
+		e = NULL;
+		while (queue->next < queue->count) {
+			e = &(queue->entries[queue->next++]);
+			if (e->active && e->path != NULL && !e->loaded)
+				break;
+			e = NULL;
+		}
+		pthread_mutex_unlock(&(queue->lock));
+		if (e == NULL)
+			break;
+		setPCFFont(e->dst, e->path, e->half);
+		e->loaded = true;
+	}
+	return NULL;
+}
+#endif
+
 static void configEffect(const char *config)
 {
 	bool found;
@@ -532,6 +934,58 @@ static void configShadowColor(const char *config)
 	}
 }
 
+static void configCache(const char *config)
+{
+	struct passwd *pw;
+	size_t length;
+
+	assert(initialized);
+
+	if (font.cache != NULL) {
+		free(font.cache);
+		font.cache = NULL;
+	}
+	if (config != NULL) {
+		if (*config == '/') {
+			font.cache = strdup(config);
+			if (font.cache == NULL)
+				err(1, "strdup()");
+		} else if (strncmp(config, "~/", 2) == 0) {
+			/* the real user, not $HOME, as jfbterm may be setuid */
+			pw = getpwuid(privilege_getUID());
+			if (pw == NULL || pw->pw_dir == NULL ||
+			    *pw->pw_dir != '/') {
+				warnx("Invalid font cache directory: %s",
+				      config);
+				return;
+			}
+			length = strlen(pw->pw_dir) + strlen(config);
+			font.cache = malloc(length);
+			if (font.cache == NULL)
+				err(1, "malloc()");
+			snprintf(font.cache, length, "%s%s", pw->pw_dir,
+				 config + 1);
+		} else
+			warnx("Invalid font cache directory: %s", config);
+	}
+}
+
+static void configScale(const char *config)
+{
+	int scale;
+
+	assert(initialized);
+
+	font.scale = DEFAULT_FONT_SCALE;
+	if (config != NULL) {
+		scale = atoi(config);
+		if (scale >= 1 && scale <= MAX_FONT_SCALE)
+			font.scale = scale;
+		else
+			warnx("Invalid font scale: %s", config);
+	}
+}
+
 void font_configure(TCaps *caps)
 {
 	TCapability *capability;
@@ -540,6 +994,11 @@ void font_configure(TCaps *caps)
 	assert(initialized);
 	assert(caps != NULL);
 
+	createDesignationTable();
+	config = caps_findFirst(caps, "font.cache");
+	configCache(config);
+	config = caps_findFirst(caps, "font.scale");
+	configScale(config);
 	capability = caps_find(caps, "fontset");
 	if (capability == NULL || capability->values == NULL)
 		errx(1, "No font specified.");
@@ -578,12 +1037,50 @@ void font_showList(FILE *stream)
 	}
 }
 
+static void createDesignationTable(void)
+{
+	TFont *p;
+	u_int final, dbcs, set96;
+	int i;
+
+	assert(initialized);
+
+	for (dbcs = 0; dbcs < 2; dbcs++)
+		for (set96 = 0; set96 < 2; set96++)
+			for (i = 0; i < DESIGNATION_FINALS; i++)
+				designation[dbcs][set96][i] = -1;
+	for (p = gFonts, i = 0; p->name != NULL; p++, i++) {
+		if (p->signature & FONT_SIGNATURE_OTHER)
+			continue;
+		final = p->signature & 0xff;
+		if (final < DESIGNATION_FINAL_MIN ||
+		    final > DESIGNATION_FINAL_MAX)
+			continue;
+		dbcs = (p->signature & FONT_SIGNATURE_DOUBLE) ? 1 : 0;
+		set96 = (p->signature & FONT_SIGNATURE_96CHAR) ? 1 : 0;
+		/* first entry wins, as in the linear search */
+		if (designation[dbcs][set96][final - DESIGNATION_FINAL_MIN] == -1)
+			designation[dbcs][set96][final - DESIGNATION_FINAL_MIN] = i;
+	}
+	designationReady = true;
+}
+
 int font_getIndexBySignature(const u_int signature)
 {
 	TFont *p;
+	u_int final;
 	int i;
 
 	/* not require any initialize */
+	final = signature & 0xff;
+	if (designationReady &&
+	    (signature & ~(FONT_SIGNATURE_DOUBLE | FONT_SIGNATURE_96CHAR |
+			   0xff)) == 0 &&
+	    final >= DESIGNATION_FINAL_MIN && final <= DESIGNATION_FINAL_MAX) {
+		return designation[(signature & FONT_SIGNATURE_DOUBLE) ? 1 : 0]
+				  [(signature & FONT_SIGNATURE_96CHAR) ? 1 : 0]
+				  [final - DESIGNATION_FINAL_MIN];
+	}
 	for (p = gFonts, i = 0; p->name != NULL; p++, i++)
 		if (p->signature == signature)
 			return i;
@@ -631,19 +1128,14 @@ static int codeToIndex(TFont *p, uint16_t code)
 	return (col - p->colf) + (row - p->rowf) * p->colspan;
 }
 
-static const u_char *getDefaultGlyph(TFont *p, uint16_t code, u_short *width)
+static void createFallbackGlyph(u_char *glyph, uint16_t code, bool wide)
 {
-	static u_char glyph[PICOFONT_HEIGHT * 2];
-
 	u_char *cp;
 	u_int i, a, b;
 
-	assert(initialized);
-	assert(p != NULL);
-	assert(width != NULL);
+	assert(glyph != NULL);
 
 	cp = glyph;
-	*width = p->width;
 	*cp++ = 0x80;
 	*cp++ = 0x00;
 	for (i = 0; i < 16; i += 4) {
@@ -660,14 +1152,54 @@ static const u_char *getDefaultGlyph(TFont *p, uint16_t code, u_short *width)
 	}
 	*cp++ = 0x80;
 	*cp++ = 0x00;
-	if (p->bytesPerChar == 2) {
+	if (wide) {
 		*cp++ = 0xff;
 		*cp = 0xfe;
 	} else {
 		*cp++ = 0xfe;
 		*cp = 0x00;
 	}
-	return glyph;
+}
+
+static u_char *createFallbackPage(uint16_t first, bool wide)
+{
+	u_char *page;
+	u_int i;
+
+	page = calloc(FALLBACK_PAGE, FALLBACK_GLYPH_SIZE);
+	if (page == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < FALLBACK_PAGE; i++)
+		createFallbackGlyph(page + i * FALLBACK_GLYPH_SIZE,
+				    first + i, wide);
+	return page;
+}
+
+static const u_char *getDefaultGlyph(TFont *p, uint16_t code, u_short *width)
+{
+	u_char *page;
+	bool wide;
+	u_int n;
+
+	assert(initialized);
+	assert(p != NULL);
+	assert(width != NULL);
+
+	wide = p->bytesPerChar == 2;
+	n = code >> FALLBACK_PAGE_SHIFT;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&fallbackGlyphsLock);
+#endif
+	page = fallbackGlyphs[wide][n];
+	if (page == NULL) {
+		page = createFallbackPage(n << FALLBACK_PAGE_SHIFT, wide);
+		fallbackGlyphs[wide][n] = page;
+	}
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&fallbackGlyphsLock);
+#endif
+	*width = p->width;
+	return page + (code & (FALLBACK_PAGE - 1)) * FALLBACK_GLYPH_SIZE;
 }
 
 static const u_char *getStandardGlyph(TFont *p, uint16_t code, u_short *width)
@@ -681,13 +1213,205 @@ static const u_char *getStandardGlyph(TFont *p, uint16_t code, u_short *width)
 	i = codeToIndex(p, code);
 	if (i == -1) {
 		*width = p->width;
-		return p->defaultGlyph;
+		return p->extra;
 	}
-	if (p->glyphWidths != NULL)
-		*width = p->glyphWidths[i];
-	else
-		*width = p->width;
-	return p->glyphs[i];
+	*width = getGlyphWidth(p, i);
+	return getGlyphAddress(p, getGlyphOffset(p, i));
+}
+
+static const u_char *getPendingGlyph(TFont *p, uint16_t code, u_short *width)
+{
+	assert(initialized);
+	assert(p != NULL);
+	assert(width != NULL);
+
+	font_load(p);
+	return p->getGlyph(p, code, width);
+}
+
+static u_int getGlyphCount(TFont *p)
+{
+	assert(p != NULL);
+
+	return (p->coll - p->colf + 1) * (p->rowl - p->rowf + 1);
+}
+
+static uint32_t getGlyphOffset(TFont *p, u_int index)
+{
+	return p->glyphPages[index >> FONT_GLYPH_PAGE_SHIFT]
+			    [index & (FONT_GLYPH_PAGE - 1)];
+}
+
+static const u_char *getGlyphAddress(TFont *p, uint32_t offset)
+{
+	if (offset & FONT_GLYPH_EXTRA)
+		return p->extra + (offset & ~FONT_GLYPH_EXTRA);
+	return p->bitmap + offset;
+}
+
+static u_short getGlyphWidth(TFont *p, u_int index)
+{
+	if (p->glyphWidths == NULL)
+		return p->width;
+	return p->widths[p->glyphWidths[index]];
+}
+
+/*
+ * Should all of widths[] be used, a glyph gets the nearest wider width,
+ * which only draws blank columns, or else the widest one.  Index 0 is
+ * p->width and is never substituted.
+ */
+static u_int getWidthIndex(TFont *p, u_short width)
+{
+	u_int i, wider, widest;
+
+	assert(p != NULL);
+
+	for (i = 0; i < p->nWidths; i++)
+		if (p->widths[i] == width)
+			return i;
+	if (p->nWidths < FONT_WIDTHS) {
+		p->widths[p->nWidths] = width;
+		return p->nWidths++;
+	}
+	if (!p->widthsOverflow) {
+		warnx("FONT : %s has more than %d glyph widths", p->name,
+		      FONT_WIDTHS);
+		p->widthsOverflow = true;
+	}
+	wider = widest = 1;
+	for (i = 1; i < p->nWidths; i++) {
+		if (p->widths[i] > width &&
+		    (p->widths[wider] < width ||
+		     p->widths[i] < p->widths[wider]))
+			wider = i;
+		if (p->widths[i] > p->widths[widest])
+			widest = i;
+	}
+	return p->widths[wider] > width ? wider : widest;
+}
+
+static void allocateGlyphWidths(TFont *p)
+{
+	assert(p != NULL);
+
+	p->glyphWidths = calloc(getGlyphCount(p), sizeof(u_char));
+	if (p->glyphWidths == NULL)
+		err(1, "calloc()");
+}
+
+static void setGlyphOffset(TFont *p, u_int index, uint32_t offset)
+{
+	uint32_t *page;
+
+	page = p->glyphPages[index >> FONT_GLYPH_PAGE_SHIFT];
+	if (page == emptyGlyphPage) {
+		if (offset == FONT_GLYPH_DEFAULT)
+			return;
+		page = malloc(sizeof(emptyGlyphPage));
+		if (page == NULL)
+			err(1, "malloc()");
+		memcpy(page, emptyGlyphPage, sizeof(emptyGlyphPage));
+		p->glyphPages[index >> FONT_GLYPH_PAGE_SHIFT] = page;
+	}
+	page[index & (FONT_GLYPH_PAGE - 1)] = offset;
+}
+
+static void setGlyphWidth(TFont *p, u_int index, u_short width)
+{
+	if (p->glyphWidths == NULL) {
+		if (width == p->width)
+			return;
+		allocateGlyphWidths(p);
+	}
+	p->glyphWidths[index] = getWidthIndex(p, width);
+}
+
+/*
+ * Set up an empty glyph directory for the size in p->colf .. p->rowl.
+ * Every glyph is the default glyph, which is all set bits.
+ */
+void font_allocateGlyphs(TFont *p, bool hasWidths)
+{
+	u_int i, pages;
+
+	assert(initialized);
+	assert(p != NULL);
+
+	pages = (getGlyphCount(p) + FONT_GLYPH_PAGE - 1) >>
+		FONT_GLYPH_PAGE_SHIFT;
+	p->glyphPages = malloc(sizeof(uint32_t *) * pages);
+	if (p->glyphPages == NULL)
+		err(1, "malloc()");
+	for (i = 0; i < pages; i++)
+		p->glyphPages[i] = emptyGlyphPage;
+	p->glyphWidths = NULL;
+	if (hasWidths)
+		allocateGlyphWidths(p);
+	p->widths[0] = p->width;
+	p->nWidths = 1;
+	p->widthsOverflow = false;
+	p->extra = malloc(p->bytesPerChar);
+	if (p->extra == NULL)
+		err(1, "malloc()");
+	memset(p->extra, 0xff, p->bytesPerChar);
+	p->extraSize = p->bytesPerChar;
+}
+
+void font_setGlyph(TFont *p, u_int index, uint32_t offset, u_short width)
+{
+	assert(initialized);
+	assert(p != NULL);
+	assert(p->glyphPages != NULL);
+
+	setGlyphOffset(p, index, offset);
+	setGlyphWidth(p, index, width);
+}
+
+/* propagate reallocated glyph data to aliases of the font */
+static void updateSharedGlyphs(TFont *p)
+{
+	TFont *q;
+
+	assert(initialized);
+	assert(p != NULL);
+
+	for (q = gFonts; q->name != NULL; q++) {
+		if (q == p || q->glyphPages != p->glyphPages)
+			continue;
+		q->glyphWidths = p->glyphWidths;
+		memcpy(q->widths, p->widths, sizeof(q->widths));
+		q->nWidths = p->nWidths;
+		q->extra = p->extra;
+		q->extraSize = p->extraSize;
+	}
+}
+
+static void freeGlyphs(TFont *p)
+{
+	u_int i, pages;
+
+	assert(p != NULL);
+
+	if (p->glyphPages != NULL) {
+		pages = (getGlyphCount(p) + FONT_GLYPH_PAGE - 1) >>
+			FONT_GLYPH_PAGE_SHIFT;
+		for (i = 0; i < pages; i++)
+			if (p->glyphPages[i] != emptyGlyphPage)
+				free(p->glyphPages[i]);
+		free(p->glyphPages);
+		p->glyphPages = NULL;
+	}
+	if (p->glyphWidths != NULL) {
+		free(p->glyphWidths);
+		p->glyphWidths = NULL;
+	}
+	if (p->extra != NULL) {
+		free(p->extra);
+		p->extra = NULL;
+	}
+	p->extraSize = 0;
+	p->nWidths = 0;
 }
 
 static void childHandler(int signum)
@@ -711,6 +1435,26 @@ static void childHandler(int signum)
 	errno = errsv;
 }
 
+static bool isCompressed(const char *path)
+{
+	assert(path != NULL);
+
+	return (strlen(path) > 3 && strrcmp(path, ".gz") == 0) ||
+	       (strlen(path) > 2 && strrcmp(path, ".Z") == 0);
+}
+
+/* fonts read through a gunzip child */
+static bool isStreamed(const char *path)
+{
+	assert(path != NULL);
+
+#ifdef HAVE_LIBZ
+	if (strlen(path) > 3 && strrcmp(path, ".gz") == 0)
+		return false;
+#endif
+	return isCompressed(path);
+}
+
 static FILE *openStream(const char *path)
 {
 	int i, fd, filedes[2];
@@ -718,8 +1462,7 @@ static FILE *openStream(const char *path)
 	assert(initialized);
 	assert(path != NULL);
 
-	if ((strlen(path) > 3 && strrcmp(path, ".gz") == 0) ||
-	    (strlen(path) > 2 && strrcmp(path, ".Z") == 0)) {
+	if (isCompressed(path)) {
 		if (pipe(filedes) == -1)
 			return NULL;
 		fflush(stdout);
@@ -760,48 +1503,778 @@ static FILE *openStream(const char *path)
 	return NULL;
 }
 
-static void setPCFFont(TFont *p, const char *path, FONT_HALF half)
+/*
+ * Map an uncompressed font privately, so that the glyph bitmaps can be
+ * used in place.  Pages are copied only if the bitmaps must be bit-swapped.
+ */
+static u_char *mapImage(const char *path, size_t *size)
 {
-	FILE *stream;
-	TPcf pcf;
+	struct stat st;
+	u_char *image;
+	int fd;
 
 	assert(initialized);
-	assert(p != NULL);
 	assert(path != NULL);
+	assert(size != NULL);
 
-	pcf_initialize(&pcf);
-	if (access(path, R_OK) != 0) {
-		warnx("PCF : READ ACCESS ERROR : %s", path);
-		return;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
 	}
-	stream = openStream(path);
-	if (stream == NULL) {
-		warnx("PCF : CANNOTOPEN : %s", path);
-		return;
-	}
-	pcf_load(&pcf, stream);
-	fclose(stream);
-	pcf_as_font(&pcf, p);
-	p->half = half;
-	p->getGlyph = getStandardGlyph;
-	pcf_finalize(&pcf);
+	image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		     fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return image;
 }
 
-static void setFontAlias(TFont *dst, TFont *src, FONT_HALF half)
+#ifdef HAVE_LIBZ
+/*
+ * Decompress a gzipped font into memory, so that it does not need a
+ * gunzip process and can be parsed in place like a mapped one.
+ */
+static u_char *inflateImage(const char *path, size_t *size)
 {
-	assert(initialized);
-	assert(dst != NULL);
-	assert(src != NULL);
+	struct stat st;
+	gzFile gz;
+	u_char *image;
+	size_t capacity, length;
+	int fd, n;
+
+	assert(initialized);
+	assert(path != NULL);
+	assert(size != NULL);
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	if ((gz = gzdopen(fd, "rb")) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	/* PCF fonts usually compress to a quarter or less */
+	capacity = st.st_size > 0 ? st.st_size * 4 : BUFSIZ;
+	image = malloc(capacity);
+	if (image == NULL)
+		err(1, "malloc()");
+	length = 0;
+	for (;;) {
+		if (length == capacity) {
+			capacity *= 2;
+			image = realloc(image, capacity);
+			if (image == NULL)
+				err(1, "realloc()");
+		}
+		n = gzread(gz, image + length, capacity - length);
+		if (n == -1) {
+			free(image);
+			gzclose(gz);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		length += n;
+	}
+	gzclose(gz);
+	*size = length;
+	return image;
+}
+#endif
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length)
+{
+	const u_char *cp;
+
+	assert(data != NULL || length == 0);
+
+	for (cp = data; length > 0; length--) {
+		hash ^= *cp++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static char *getFontCachePath(const char *path, bool unifont,
+			      const char *suffix)
+{
+	char *cachePath;
+	size_t length;
+	uint32_t hash;
+
+	assert(initialized);
+	assert(font.cache != NULL);
+	assert(path != NULL);
+	assert(suffix != NULL);
+
+	/* <cache>/<hash>[u].cache<suffix>, the hash also covers font.scale */
+	length = strlen(font.cache) + strlen("/12345678u.cache") +
+		 strlen(suffix) + 1;
+	cachePath = malloc(length);
+	if (cachePath == NULL)
+		err(1, "malloc()");
+	hash = fnv1a(2166136261U, path, strlen(path));
+	if (font.scale != 1)
+		hash = fnv1a(hash, &font.scale, sizeof(font.scale));
+	snprintf(cachePath, length, "%s/%08x%s.cache%s", font.cache, hash,
+		 unifont ? "u" : "", suffix);
+	return cachePath;
+}
+
+static void getFontCacheLayout(const struct fontCacheHeader *header,
+			       struct fontCacheLayout *layout)
+{
+	assert(header != NULL);
+	assert(layout != NULL);
+
+	layout->path = sizeof(struct fontCacheHeader);
+	layout->glyphs = layout->path + FONT_CACHE_ALIGN(header->pathLength);
+	layout->widths = layout->glyphs +
+			 (size_t)header->glyphs * sizeof(uint32_t);
+	layout->variants = layout->widths + (header->hasWidths ?
+		FONT_CACHE_ALIGN((size_t)header->glyphs) : 0);
+	layout->bitmap = layout->variants +
+		(size_t)header->variants * sizeof(struct fontCacheVariant);
+	layout->extra = layout->bitmap + FONT_CACHE_ALIGN(
+		(size_t)header->bitmapSize + header->bytesPerChar);
+	layout->total = layout->extra + header->extraSize;
+}
+
+/* the bitmap is padded by one glyph, see getFontCacheLayout() */
+static bool isValidCacheOffset(const struct fontCacheHeader *header,
+			       uint32_t offset, size_t size)
+{
+	assert(header != NULL);
+
+	if (offset & FONT_GLYPH_EXTRA)
+		return (offset & ~FONT_GLYPH_EXTRA) + size <=
+		       header->extraSize;
+	return offset + size <=
+	       (size_t)header->bitmapSize + header->bytesPerChar;
+}
+
+/*
+ * Only the real user or root may have written a cache, since its glyphs
+ * are used as they are.
+ */
+static bool isTrustedCache(const struct stat *st)
+{
+	assert(st != NULL);
+
+	return (st->st_uid == privilege_getUID() || st->st_uid == 0) &&
+	       (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+static bool isTrustedCacheDirectory(void)
+{
+	struct stat st;
+
+	assert(font.cache != NULL);
+
+	return stat(font.cache, &st) == 0 && S_ISDIR(st.st_mode) &&
+	       isTrustedCache(&st);
+}
+
+/*
+ * Map a font cache which matches the source font.  Any mismatch or
+ * corruption just makes the caller fall back to the PCF file.
+ */
+static bool loadFontCache(TFont *p, const char *path,
+			  const struct stat *source, bool unifont)
+{
+	struct fontCacheHeader *header;
+	struct fontCacheLayout layout;
+	struct stat st;
+	u_char *image, *widths;
+	uint32_t *offsets;
+	char *cachePath;
+	uint32_t i;
+	int fd;
+#ifdef ENABLE_UTF8
+	struct fontCacheVariant *variant;
+#endif
+
+	assert(initialized);
+	assert(p != NULL);
+	assert(path != NULL);
+	assert(source != NULL);
+
+	if (font.cache == NULL || !isTrustedCacheDirectory())
+		return false;
+	cachePath = getFontCachePath(path, unifont, "");
+	fd = open(cachePath, O_RDONLY);
+	free(cachePath);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    !isTrustedCache(&st) ||
+	    st.st_size < (off_t)sizeof(struct fontCacheHeader)) {
+		close(fd);
+		return false;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		     fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return false;
+	header = (struct fontCacheHeader *)image;
+	if (memcmp(header->magic, FONT_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != FONT_CACHE_VERSION ||
+	    header->sourceSize != (int64_t)source->st_size ||
+	    header->sourceMtime != (int64_t)source->st_mtime ||
+	    header->unifont != (unifont ? 1 : 0) ||
+	    header->scale != font.scale ||
+	    header->pathLength != strlen(path) ||
+	    header->width == 0 || header->height == 0 ||
+	    header->bytesPerWidth == 0 ||
+	    header->width > header->bytesPerWidth * 8 ||
+	    header->bytesPerChar !=
+	    (size_t)header->bytesPerWidth * header->height ||
+	    header->colf > header->coll || header->rowf > header->rowl ||
+	    header->coll > 0xff || header->rowl > 0xff ||
+	    header->glyphs != (header->coll - header->colf + 1) *
+			      (header->rowl - header->rowf + 1) ||
+	    header->nWidths == 0 || header->nWidths > FONT_WIDTHS ||
+	    header->extraSize < header->bytesPerChar ||
+	    header->extraSize >= FONT_GLYPH_EXTRA)
+		goto invalid;
+	getFontCacheLayout(header, &layout);
+	if (layout.total != (size_t)st.st_size ||
+	    memcmp(image + layout.path, path, header->pathLength) != 0 ||
+	    header->checksum != fnv1a(2166136261U,
+				      image + sizeof(struct fontCacheHeader),
+				      layout.total -
+				      sizeof(struct fontCacheHeader)))
+		goto invalid;
+	offsets = (uint32_t *)(image + layout.glyphs);
+	for (i = 0; i < header->glyphs; i++)
+		if (!isValidCacheOffset(header, offsets[i],
+					header->bytesPerChar))
+			goto invalid;
+	widths = image + layout.widths;
+	if (header->hasWidths) {
+		for (i = 0; i < header->glyphs; i++)
+			if (widths[i] >= header->nWidths)
+				goto invalid;
+	}
+#ifdef ENABLE_UTF8
+	/* see createUnifontGlyph() for the size of each variant */
+	variant = (struct fontCacheVariant *)(image + layout.variants);
+	for (i = 0; i < header->variants; i++, variant++)
+		if ((variant->halfWidthGlyph != UNIFONT_GLYPH_NONE &&
+		     !isValidCacheOffset(header, variant->halfWidthGlyph,
+					 isFullWidth(variant->ucs2) ?
+					 header->bytesPerChar * 2 :
+					 header->bytesPerChar)) ||
+		    (variant->fullWidthGlyph != UNIFONT_GLYPH_NONE &&
+		     !isValidCacheOffset(header, variant->fullWidthGlyph,
+					 header->bytesPerChar * 2)))
+			goto invalid;
+#else
+	if (header->variants != 0)
+		goto invalid;
+#endif
+
+	p->width = header->width;
+	p->height = header->height;
+	p->bytesPerWidth = header->bytesPerWidth;
+	p->bytesPerChar = header->bytesPerChar;
+	p->colf = header->colf;
+	p->coll = header->coll;
+	p->rowf = header->rowf;
+	p->rowl = header->rowl;
+	p->colspan = p->coll - p->colf + 1;
+	font_allocateGlyphs(p, header->hasWidths != 0);
+	for (i = 0; i < header->glyphs; i++)
+		setGlyphOffset(p, i, offsets[i]);
+	if (header->hasWidths)
+		memcpy(p->glyphWidths, widths, header->glyphs);
+	memcpy(p->widths, header->widths, sizeof(p->widths));
+	p->nWidths = header->nWidths;
+	/* extra is owned by the font, as unifont variants are added to it */
+	free(p->extra);
+	p->extra = malloc(header->extraSize);
+	if (p->extra == NULL)
+		err(1, "malloc()");
+	memcpy(p->extra, image + layout.extra, header->extraSize);
+	p->extraSize = header->extraSize;
+	p->bitmap = image + layout.bitmap;
+	p->bitmapSize = header->bitmapSize;
+	p->image = image;
+	p->imageSize = st.st_size;
+	p->imageMapped = true;
+#ifdef ENABLE_UTF8
+	variant = (struct fontCacheVariant *)(image + layout.variants);
+	for (i = 0; i < header->variants; i++, variant++)
+		unifontGlyphList_add(variant->ucs2, variant->ambiguous != 0,
+				     variant->halfWidthGlyph,
+				     variant->halfWidthGlyphWidth,
+				     variant->fullWidthGlyph,
+				     variant->fullWidthGlyphWidth);
+	if (unifont)
+		unifontGlyphListInCache = true;
+#endif
+	return true;
+
+invalid:
+	munmap(image, st.st_size);
+	return false;
+}
+
+static bool isReadOnlyError(int error)
+{
+	return error == EACCES || error == EPERM || error == EROFS;
+}
+
+static void saveFontCache(TFont *p, bool unifont)
+{
+	struct fontCacheHeader header;
+	struct fontCacheLayout layout;
+	struct stat source;
+	u_char *image;
+	uint32_t *offsets;
+	char *cachePath, *tmpPath;
+	uint32_t i;
+	int fd;
+#ifdef ENABLE_UTF8
+	struct fontCacheVariant *variant;
+	struct unifontGlyphList *current;
+#endif
+
+	assert(initialized);
+	assert(p != NULL);
+
+	if (font.cache == NULL || p->path == NULL || p->glyphPages == NULL)
+		return;
+	if (stat(p->path, &source) == -1)
+		return;
+	/* a read-only cache is only used, never refreshed */
+	if (mkdir(font.cache, 0755) == -1 && errno != EEXIST) {
+		if (!isReadOnlyError(errno))
+			warn("FONT : Could not create cache directory %s",
+			     font.cache);
+		return;
+	}
+	if (access(font.cache, W_OK) == -1 || !isTrustedCacheDirectory())
+		return;
+
+	bzero(&header, sizeof(header));
+	memcpy(header.magic, FONT_CACHE_MAGIC, sizeof(header.magic));
+	header.version = FONT_CACHE_VERSION;
+	header.sourceSize = source.st_size;
+	header.sourceMtime = source.st_mtime;
+	header.pathLength = strlen(p->path);
+	header.unifont = unifont ? 1 : 0;
+	header.scale = font.scale;
+	header.width = p->width;
+	header.height = p->height;
+	header.bytesPerWidth = p->bytesPerWidth;
+	header.bytesPerChar = p->bytesPerChar;
+	header.colf = p->colf;
+	header.coll = p->coll;
+	header.rowf = p->rowf;
+	header.rowl = p->rowl;
+	header.glyphs = getGlyphCount(p);
+	header.hasWidths = p->glyphWidths != NULL ? 1 : 0;
+	memcpy(header.widths, p->widths, sizeof(header.widths));
+	header.nWidths = p->nWidths;
+#ifdef ENABLE_UTF8
+	if (unifont) {
+		for (current = unifontGlyphList; current != NULL;
+		     current = current->next)
+			header.variants++;
+	}
+#endif
+	header.bitmapSize = p->bitmapSize;
+	header.extraSize = p->extraSize;
+	getFontCacheLayout(&header, &layout);
+
+	image = calloc(layout.total, sizeof(u_char));
+	if (image == NULL)
+		err(1, "calloc()");
+	memcpy(image + layout.path, p->path, header.pathLength);
+	offsets = (uint32_t *)(image + layout.glyphs);
+	for (i = 0; i < header.glyphs; i++) {
+		offsets[i] = getGlyphOffset(p, i);
+		if (!(offsets[i] & FONT_GLYPH_EXTRA) &&
+		    offsets[i] > p->bitmapSize) {
+			free(image); /* glyph outside of the bitmap */
+			return;
+		}
+	}
+	if (header.hasWidths)
+		memcpy(image + layout.widths, p->glyphWidths, header.glyphs);
+#ifdef ENABLE_UTF8
+	if (unifont) {
+		variant = (struct fontCacheVariant *)(image + layout.variants);
+		for (current = unifontGlyphList; current != NULL;
+		     current = current->next, variant++) {
+			variant->ucs2 = current->ucs2;
+			variant->ambiguous = current->ambiguous ? 1 : 0;
+			variant->halfWidthGlyph = current->halfWidthGlyph;
+			variant->halfWidthGlyphWidth =
+					current->halfWidthGlyphWidth;
+			variant->fullWidthGlyph = current->fullWidthGlyph;
+			variant->fullWidthGlyphWidth =
+					current->fullWidthGlyphWidth;
+		}
+	}
+#endif
+	memcpy(image + layout.bitmap, p->bitmap, p->bitmapSize);
+	memcpy(image + layout.extra, p->extra, p->extraSize);
+	header.checksum = fnv1a(2166136261U,
+				image + sizeof(struct fontCacheHeader),
+				layout.total - sizeof(struct fontCacheHeader));
+	memcpy(image, &header, sizeof(header));
+
+	cachePath = getFontCachePath(p->path, unifont, "");
+	tmpPath = getFontCachePath(p->path, unifont, ".XXXXXX");
+	if ((fd = mkstemp(tmpPath)) == -1) {
+		if (!isReadOnlyError(errno))
+			warn("FONT : Could not write cache %s", cachePath);
+	} else {
+		fchmod(fd, 0644);
+		if (write_wrapper(fd, image, layout.total) !=
+		    (ssize_t)layout.total) {
+			warn("FONT : Could not write cache %s", cachePath);
+			close(fd);
+			unlink(tmpPath);
+		} else {
+			close(fd);
+			if (rename(tmpPath, cachePath) == -1) {
+				warn("rename()");
+				unlink(tmpPath);
+			}
+		}
+	}
+	free(tmpPath);
+	free(cachePath);
+	free(image);
+}
+
+static int compareOffset(const void *a, const void *b)
+{
+	uint32_t x, y;
+
+	x = *(const uint32_t *)a;
+	y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* enlarge one glyph of p by font.scale; bytes past size read as blank */
+static void scaleGlyph(TFont *p, const u_char *glyph, size_t size,
+		       u_char *scaled)
+{
+	u_int x, y, k, bit, bytesPerWidth;
+	size_t o;
+	u_char *d;
+
+	assert(p != NULL);
+	assert(glyph != NULL);
+	assert(scaled != NULL);
+
+	bytesPerWidth = p->bytesPerWidth * font.scale;
+	for (y = 0; y < p->height; y++) {
+		d = scaled + y * font.scale * bytesPerWidth;
+		for (x = 0; x < p->bytesPerWidth * 8U; x++) {
+			o = y * p->bytesPerWidth + (x >> 3);
+			if (o >= size)
+				break;
+			if (!(glyph[o] & (0x80 >> (x & 7))))
+				continue;
+			for (k = 0; k < font.scale; k++) {
+				bit = x * font.scale + k;
+				d[bit >> 3] |= 0x80 >> (bit & 7);
+			}
+		}
+		for (k = 1; k < font.scale; k++)
+			memcpy(d + k * bytesPerWidth, d, bytesPerWidth);
+	}
+}
+
+/*
+ * Replace the bitmap and extra of a just loaded font by copies enlarged
+ * by font.scale, so that font_draw() never has to scale.  A glyph which
+ * is shared by several codes is scaled only once.
+ */
+static void scaleFont(TFont *p)
+{
+	uint32_t *offsets, *page, *found, offset;
+	u_int i, n, count, glyphs, pages;
+	size_t bytesPerChar, bitmapSize;
+	u_char *bitmap, *extra;
+
+	assert(initialized);
+	assert(p != NULL);
+
+	if (font.scale == 1 || p->glyphPages == NULL)
+		return;
+	glyphs = getGlyphCount(p);
+	offsets = malloc(sizeof(uint32_t) * (glyphs + 1));
+	if (offsets == NULL)
+		err(1, "malloc()");
+	count = 0;
+	for (i = 0; i < glyphs; i++) {
+		offset = getGlyphOffset(p, i);
+		if (!(offset & FONT_GLYPH_EXTRA))
+			offsets[count++] = offset;
+	}
+	qsort(offsets, count, sizeof(uint32_t), compareOffset);
+	for (i = n = 0; i < count; i++)
+		if (n == 0 || offsets[n - 1] != offsets[i])
+			offsets[n++] = offsets[i];
+	count = n;
+
+	bytesPerChar = (size_t)p->bytesPerChar * font.scale * font.scale;
+	bitmapSize = count * bytesPerChar;
+	if (bytesPerChar > 0xffff || bitmapSize >= FONT_GLYPH_EXTRA ||
+	    (p->extraSize / p->bytesPerChar) * bytesPerChar >=
+	    FONT_GLYPH_EXTRA) {
+		warnx("FONT : Font too large to scale : %s", p->path);
+		free(offsets);
+		return;
+	}
+	/* padded like a cache bitmap, so that count may be 0 */
+	bitmap = calloc(bitmapSize + bytesPerChar, sizeof(u_char));
+	if (bitmap == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < count; i++)
+		scaleGlyph(p, p->bitmap + offsets[i],
+			   offsets[i] < p->bitmapSize ?
+			   p->bitmapSize - offsets[i] : 0,
+			   bitmap + i * bytesPerChar);
+	extra = calloc(p->extraSize / p->bytesPerChar, bytesPerChar);
+	if (extra == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < p->extraSize / p->bytesPerChar; i++)
+		scaleGlyph(p, p->extra + i * p->bytesPerChar, p->bytesPerChar,
+			   extra + i * bytesPerChar);
+
+	pages = (glyphs + FONT_GLYPH_PAGE - 1) >> FONT_GLYPH_PAGE_SHIFT;
+	for (i = 0; i < pages; i++) {
+		page = p->glyphPages[i];
+		if (page == emptyGlyphPage)
+			continue;
+		for (n = 0; n < FONT_GLYPH_PAGE; n++) {
+			if (page[n] & FONT_GLYPH_EXTRA) {
+				page[n] = FONT_GLYPH_EXTRA |
+					  ((page[n] & ~FONT_GLYPH_EXTRA) /
+					   p->bytesPerChar * bytesPerChar);
+				continue;
+			}
+			found = bsearch(&page[n], offsets, count,
+					sizeof(uint32_t), compareOffset);
+			assert(found != NULL);
+			page[n] = (found - offsets) * bytesPerChar;
+		}
+	}
+	free(offsets);
+
+	if (p->image != NULL) {
+		if (p->imageMapped)
+			munmap(p->image, p->imageSize);
+		else
+			free(p->image);
+		p->image = NULL;
+		p->imageSize = 0;
+		p->imageMapped = false;
+	} else
+		free(p->bitmap);
+	p->bitmap = bitmap;
+	p->bitmapSize = bitmapSize;
+	free(p->extra);
+	p->extra = extra;
+	p->extraSize = (p->extraSize / p->bytesPerChar) * bytesPerChar;
+	for (i = 0; i < p->nWidths; i++)
+		p->widths[i] *= font.scale;
+	p->width *= font.scale;
+	p->height *= font.scale;
+	p->bytesPerWidth *= font.scale;
+	p->bytesPerChar = bytesPerChar;
+}
+
+static void setPCFFont(TFont *p, const char *path, FONT_HALF half)
+{
+	FILE *stream;
+	TPcf pcf;
+	struct stat st;
+	u_char *image;
+	size_t imageSize;
+	bool imageMapped, unifont, loaded;
+	char buf[BUFSIZ];
+
+	assert(initialized);
+	assert(p != NULL);
+	assert(path != NULL);
+
+	pcf_initialize(&pcf);
+	if (access(path, R_OK) != 0 || stat(path, &st) == -1) {
+		warnx("PCF : READ ACCESS ERROR : %s", path);
+		return;
+	}
+#ifdef ENABLE_UTF8
+	/* unifont variants are derived for iso10646.1 only */
+	unifont = half == FONT_HALF_UNI &&
+		  strcasecmp(p->name, "iso10646.1") == 0;
+#else
+	unifont = false;
+#endif
+	p->path = strdup(path);
+	if (p->path == NULL)
+		err(1, "strdup()");
+	if (loadFontCache(p, path, &st, unifont)) {
+		p->half = half;
+		p->getGlyph = getStandardGlyph;
+		return;
+	}
+	image = NULL;
+	imageSize = 0;
+	imageMapped = false;
+#ifdef HAVE_LIBZ
+	if (strlen(path) > 3 && strrcmp(path, ".gz") == 0) {
+		image = inflateImage(path, &imageSize);
+		if (image == NULL) {
+			warnx("PCF : CANNOTOPEN : %s", path);
+			free(p->path);
+			p->path = NULL;
+			return;
+		}
+		loaded = pcf_loadImage(&pcf, image, imageSize);
+	} else
+#endif
+	if (isCompressed(path)) {
+		stream = openStream(path);
+		if (stream == NULL) {
+			warnx("PCF : CANNOTOPEN : %s", path);
+			free(p->path);
+			p->path = NULL;
+			return;
+		}
+		loaded = pcf_load(&pcf, stream);
+		/* let gunzip finish rather than die of SIGPIPE */
+		while (fread(buf, 1, sizeof(buf), stream) > 0)
+			;
+		fclose(stream);
+	} else {
+		image = mapImage(path, &imageSize);
+		if (image == NULL) {
+			warnx("PCF : CANNOTOPEN : %s", path);
+			free(p->path);
+			p->path = NULL;
+			return;
+		}
+		imageMapped = true;
+		loaded = pcf_loadImage(&pcf, image, imageSize);
+	}
+	if (!loaded) {
+		/* the font draws as default glyphs, and is not tried again */
+		warnx("PCF : BROKEN FONT : %s", path);
+		pcf_finalize(&pcf);
+		if (imageMapped)
+			munmap(image, imageSize);
+		else if (image != NULL)
+			free(image);
+		free(p->path);
+		p->path = NULL;
+		return;
+	}
+	pcf_as_font(&pcf, p);
+	p->image = image;
+	p->imageSize = imageSize;
+	p->imageMapped = imageMapped;
+	p->half = half;
+	p->getGlyph = getStandardGlyph;
+	pcf_finalize(&pcf);
+	scaleFont(p);
+	if (!unifont)
+		saveFontCache(p, false);
+}
+
+/*
+ * Record a font to be loaded on first use.  It draws as a default glyph
+ * if the load fails.
+ */
+static void setPendingFont(TFont *p, const char *path, FONT_HALF half)
+{
+	assert(initialized);
+	assert(p != NULL);
+	assert(path != NULL);
+
+	if (access(path, R_OK) != 0) {
+		warnx("PCF : READ ACCESS ERROR : %s", path);
+		return;
+	}
+	if (p->path != NULL)
+		free(p->path);
+	p->path = strdup(path);
+	if (p->path == NULL)
+		err(1, "strdup()");
+	p->half = half;
+	p->getGlyph = getPendingGlyph;
+}
+
+static void loadPendingFont(TFont *p)
+{
+	char *path;
+
+	assert(initialized);
+	assert(p != NULL);
+
+	if (p->getGlyph != getPendingGlyph)
+		return;
+	p->getGlyph = getDefaultGlyph;
+	if (p->alias) {
+		loadPendingFont(p->aliasOf);
+		setFontAlias(p, p->aliasOf, p->half);
+		return;
+	}
+	path = p->path;
+	p->path = NULL;
+	setPCFFont(p, path, p->half);
+	free(path);
+}
+
+/* fonts needed before anything is designated */
+static bool isPreloadFont(TFont *p)
+{
+	assert(initialized);
+	assert(p != NULL);
+
+	if (p == &(gFonts[0]))
+		return true;
+#ifdef ENABLE_UTF8
+	if (strcasecmp(p->name, "iso10646.1") == 0)
+		return true;
+#endif
+	return false;
+}
+
+static void setFontAlias(TFont *dst, TFont *src, FONT_HALF half)
+{
+	assert(initialized);
+	assert(dst != NULL);
+	assert(src != NULL);
 
 	dst->getGlyph = src->getGlyph;
 	dst->width = src->width;
 	dst->height = src->height;
 	dst->half = half;
 	dst->alias = true;
-	dst->glyphs = src->glyphs;
+	dst->aliasOf = src;
+	dst->glyphPages = src->glyphPages;
 	dst->glyphWidths = src->glyphWidths;
-	dst->defaultGlyph = src->defaultGlyph;
+	memcpy(dst->widths, src->widths, sizeof(dst->widths));
+	dst->nWidths = src->nWidths;
+	dst->extra = src->extra;
+	dst->extraSize = src->extraSize;
 	dst->bitmap = src->bitmap;
+	dst->bitmapSize = src->bitmapSize;
 	dst->colf = src->colf;
 	dst->coll = src->coll;
 	dst->rowf = src->rowf;
@@ -828,7 +2301,8 @@ static void setFontsSize(void)
 	}
 	if (PICOFONT_WIDTH <= gFontsWidth && PICOFONT_HEIGHT <= gFontsHeight) {
 		for (p = gFonts; p->name != NULL; p++) {
-			if (p->getGlyph == getDefaultGlyph) {
+			if (p->getGlyph == getDefaultGlyph ||
+			    p->getGlyph == getPendingGlyph) {
 				p->height = PICOFONT_HEIGHT;
 				p->width = PICOFONT_WIDTH * p->width;
 			}
@@ -844,6 +2318,21 @@ bool font_isLoaded(TFont *p)
 	return p->getGlyph != getDefaultGlyph;
 }
 
+/* Fonts change under the framebuffer lock, so never under font_draw(). */
+void font_load(TFont *p)
+{
+	assert(initialized);
+	assert(p != NULL);
+
+	framebuffer_lock();
+	if (p->getGlyph != getPendingGlyph) {
+		framebuffer_unlock();
+		return;
+	}
+	loadPendingFont(p);
+	framebuffer_unlock();
+}
+
 #ifdef ENABLE_UTF8
 static bool isFullWidth(uint16_t ucs2)
 {
@@ -871,18 +2360,19 @@ static void unifontGlyphList_initialize(void)
 }
 
 static void unifontGlyphList_add(uint16_t ucs2, bool ambiguous,
-				 u_char *halfWidthGlyph,
+				 uint32_t halfWidthGlyph,
 				 u_short halfWidthGlyphWidth,
-				 u_char *fullWidthGlyph,
+				 uint32_t fullWidthGlyph,
 				 u_short fullWidthGlyphWidth)
 {
-	struct unifontGlyphList *p, *n;
+	struct unifontGlyphList *n;
 
 	n = malloc(sizeof(struct unifontGlyphList));
 	if (n == NULL)
 		err(1, "malloc()");
 	n->ucs2 = ucs2;
-	n->glyph = NULL;
+	n->saved = false;
+	n->glyph = 0;
 	n->glyphWidth = 0;
 	n->ambiguous = ambiguous;
 	n->halfWidthGlyph = halfWidthGlyph;
@@ -890,13 +2380,11 @@ static void unifontGlyphList_add(uint16_t ucs2, bool ambiguous,
 	n->fullWidthGlyph = fullWidthGlyph;
 	n->fullWidthGlyphWidth = fullWidthGlyphWidth;
 	n->next = NULL;
-	if (unifontGlyphList != NULL) {
-		p = unifontGlyphList;
-		while (p->next != NULL)
-			p = p->next;
-		p->next = n;
-	} else
+	if (unifontGlyphList != NULL)
+		unifontGlyphListTail->next = n;
+	else
 		unifontGlyphList = n;
+	unifontGlyphListTail = n;
 }
 
 static void unifontGlyphList_finalize(void)
@@ -906,21 +2394,21 @@ static void unifontGlyphList_finalize(void)
 	current = unifontGlyphList;
 	while (current != NULL) {
 		next = current->next;
-		if (current->halfWidthGlyph != NULL)
-			free(current->halfWidthGlyph);
-		if (current->fullWidthGlyph != NULL)
-			free(current->fullWidthGlyph);
 		free(current);
 		current = next;
 	}
 	unifontGlyphList = NULL;
+	unifontGlyphListTail = NULL;
+	unifontGlyphListInCache = false;
 }
 
 static u_char *createFullWidthGlyph(TFont *p, uint16_t ucs2,
 				    u_short *glyphWidth)
 {
 	int i, x, y;
-	u_char *glyph, *s, *d, *cp, c;
+	u_char *glyph, *d, c;
+	const u_char *s, *cp;
+	u_short width;
 
 	assert(initialized);
 	assert(p != NULL);
@@ -929,16 +2417,17 @@ static u_char *createFullWidthGlyph(TFont *p, uint16_t ucs2,
 	i = codeToIndex(p, ucs2);
 	if (i == -1)
 		return NULL; /* out of range */
-	if (p->width != p->glyphWidths[i])
+	width = getGlyphWidth(p, i);
+	if (p->width != width)
 		return NULL; /* fullwidth */
 	glyph = calloc(p->bytesPerWidth * 2 * p->height, sizeof(u_char));
 	if (glyph == NULL)
 		err(1, "calloc()");
-	s = p->glyphs[i];
+	s = getGlyphAddress(p, getGlyphOffset(p, i));
 	for (y = 0; y < p->height; y++) {
 		cp = s;
 		d = glyph + (y * p->bytesPerWidth);
-		for (x = p->glyphWidths[i]; x >= 8; x -= 8) {
+		for (x = width; x >= 8; x -= 8) {
 			c = *cp++;
 			if (c & 0x80) d[0] |= 0xc0;
 			if (c & 0x40) d[0] |= 0x30;
@@ -963,7 +2452,7 @@ static u_char *createFullWidthGlyph(TFont *p, uint16_t ucs2,
 		}
 		s += p->bytesPerWidth;
 	}
-	*glyphWidth = p->glyphWidths[i] * 2;
+	*glyphWidth = width * 2;
 	return glyph;
 }
 
@@ -971,7 +2460,9 @@ static u_char *createHalfWidthGlyph(TFont *p, uint16_t ucs2,
 				    u_short *glyphWidth)
 {
 	int i, x, y;
-	u_char *glyph, *s, *d, *cp, c;
+	u_char *glyph, *d, c;
+	const u_char *s, *cp;
+	u_short width;
 
 	assert(initialized);
 	assert(p != NULL);
@@ -980,16 +2471,17 @@ static u_char *createHalfWidthGlyph(TFont *p, uint16_t ucs2,
 	i = codeToIndex(p, ucs2);
 	if (i == -1)
 		return NULL; /* out of range */
-	if (p->width == p->glyphWidths[i])
+	width = getGlyphWidth(p, i);
+	if (p->width == width)
 		return NULL; /* halfwidth */
 	glyph = calloc(p->bytesPerWidth * p->height, sizeof(u_char));
 	if (glyph == NULL)
 		err(1, "calloc()");
-	s = p->glyphs[i];
+	s = getGlyphAddress(p, getGlyphOffset(p, i));
 	for (y = 0; y < p->height; y++) {
 		cp = s;
 		d = glyph + (y * p->bytesPerWidth);
-		for (x = p->glyphWidths[i]; x >= 16; x -= 16) {
+		for (x = width; x >= 16; x -= 16) {
 			c = *cp++;
 			if ((c & 0x80) || (c & 0x40)) *d |= 0x80;
 			if ((c & 0x20) || (c & 0x10)) *d |= 0x40;
@@ -1018,15 +2510,40 @@ static u_char *createHalfWidthGlyph(TFont *p, uint16_t ucs2,
 		}
 		s += p->bytesPerWidth;
 	}
-	*glyphWidth = (p->glyphWidths[i] / 2);
+	*glyphWidth = (width / 2);
 	return glyph;
 }
 
+static uint32_t appendExtraGlyph(TFont *p, const u_char *glyph,
+				 size_t size, u_short glyphWidth)
+{
+	uint32_t offset;
+	u_char *extra;
+
+	assert(initialized);
+	assert(p != NULL);
+	assert(glyph != NULL);
+	assert(p->extraSize + size < FONT_GLYPH_EXTRA);
+
+	flushRotatedGlyphs();
+	extra = realloc(p->extra, p->extraSize + size);
+	if (extra == NULL)
+		err(1, "realloc()");
+	p->extra = extra;
+	offset = FONT_GLYPH_EXTRA | p->extraSize;
+	memcpy(p->extra + p->extraSize, glyph, size);
+	p->extraSize += size;
+	getWidthIndex(p, glyphWidth);
+	return offset;
+}
+
 static void createUnifontGlyph(TFont *p)
 {
 	uint16_t ucs2;
 	u_char *halfWidthGlyph, *fullWidthGlyph;
 	u_short halfWidthGlyphWidth, fullWidthGlyphWidth;
+	uint32_t halfWidthOffset, fullWidthOffset;
+	size_t halfSize, fullSize, halfWidthGlyphSize;
 	bool ambiguous;
 
 	assert(initialized);
@@ -1036,37 +2553,66 @@ static void createUnifontGlyph(TFont *p)
 		return; /* font is not unifont */
 	if (!font_isLoaded(p))
 		return; /* unifont is not loaded */
+	if (unifontGlyphListInCache) {
+		/* variants were restored from the font cache */
+		saveUnifontGlyph(p);
+		return;
+	}
 	halfWidthGlyph = fullWidthGlyph = NULL;
 	halfWidthGlyphWidth = fullWidthGlyphWidth = 0;
+	/* see createHalfWidthGlyph() and createFullWidthGlyph() */
+	halfSize = p->bytesPerWidth * p->height;
+	fullSize = p->bytesPerWidth * 2 * p->height;
 	for (ucs2 = 0x0000; ucs2 != 0xffff; ucs2++) {
 		if (isFullWidth(ucs2)) {
 			halfWidthGlyph = createFullWidthGlyph(p, ucs2,
 							&halfWidthGlyphWidth);
+			halfWidthGlyphSize = fullSize;
 			fullWidthGlyph = NULL;
 			fullWidthGlyphWidth = 0;
 			ambiguous = false;
 		} else if (isHalfWidth(ucs2)) {
 			halfWidthGlyph = createHalfWidthGlyph(p, ucs2,
 							&halfWidthGlyphWidth);
+			halfWidthGlyphSize = halfSize;
 			fullWidthGlyph = NULL;
 			fullWidthGlyphWidth = 0;
 			ambiguous = false;
 		} else if (isAmbiguous(ucs2)) {
 			halfWidthGlyph = createHalfWidthGlyph(p, ucs2,
 							&halfWidthGlyphWidth);
+			halfWidthGlyphSize = halfSize;
 			fullWidthGlyph = createFullWidthGlyph(p, ucs2,
 							&fullWidthGlyphWidth);
 			ambiguous = true;
 		} else
 			continue;
-		if (halfWidthGlyph != NULL || fullWidthGlyph != NULL)
-			unifontGlyphList_add(ucs2, ambiguous,
-					     halfWidthGlyph,
-					     halfWidthGlyphWidth,
-					     fullWidthGlyph,
-					     fullWidthGlyphWidth);
+		if (halfWidthGlyph == NULL && fullWidthGlyph == NULL)
+			continue;
+		halfWidthOffset = fullWidthOffset = UNIFONT_GLYPH_NONE;
+		if (halfWidthGlyph != NULL) {
+			halfWidthOffset = appendExtraGlyph(p, halfWidthGlyph,
+							   halfWidthGlyphSize,
+							   halfWidthGlyphWidth);
+			free(halfWidthGlyph);
+		}
+		if (fullWidthGlyph != NULL) {
+			fullWidthOffset = appendExtraGlyph(p, fullWidthGlyph,
+							   fullSize,
+							   fullWidthGlyphWidth);
+			free(fullWidthGlyph);
+		}
+		unifontGlyphList_add(ucs2, ambiguous,
+				     halfWidthOffset, halfWidthGlyphWidth,
+				     fullWidthOffset, fullWidthGlyphWidth);
 	}
+	/* variants may be swapped in later, so the widths must be ready */
+	if (unifontGlyphList != NULL && p->glyphWidths == NULL)
+		allocateGlyphWidths(p);
+	updateSharedGlyphs(p);
 	saveUnifontGlyph(p);
+	if (!p->alias)
+		saveFontCache(p, true);
 }
 
 static void saveUnifontGlyph(TFont *p)
@@ -1086,9 +2632,10 @@ static void saveUnifontGlyph(TFont *p)
 		i = codeToIndex(p, current->ucs2);
 		if (i == -1)
 			return; /* out of range */
-		if (current->glyph == NULL) {
-			current->glyph = p->glyphs[i];
-			current->glyphWidth = p->glyphWidths[i];
+		if (!current->saved) {
+			current->glyph = getGlyphOffset(p, i);
+			current->glyphWidth = getGlyphWidth(p, i);
+			current->saved = true;
 		}
 	}
 }
@@ -1110,14 +2657,23 @@ static void restoreUnifontGlyph(TFont *p)
 		i = codeToIndex(p, current->ucs2);
 		if (i == -1)
 			return; /* out of range */
-		if (current->glyph != NULL) {
-			p->glyphs[i] = current->glyph;
-			p->glyphWidths[i] = current->glyphWidth;
-		}
+		if (current->saved)
+			font_setGlyph(p, i, current->glyph,
+				      current->glyphWidth);
 	}
 }
 
 void font_unifontGlyph(TFont *p, int ambiguousWidth)
+{
+	assert(initialized);
+	assert(p != NULL);
+
+	framebuffer_lock();
+	setUnifontGlyph(p, ambiguousWidth);
+	framebuffer_unlock();
+}
+
+static void setUnifontGlyph(TFont *p, int ambiguousWidth)
 {
 	int i;
 	struct unifontGlyphList *current;
@@ -1139,26 +2695,20 @@ void font_unifontGlyph(TFont *p, int ambiguousWidth)
 			return; /* out of range */
 		if (current->ambiguous) {
 			if (ambiguousWidth == 1 &&
-			    current->halfWidthGlyph != NULL) {
-				p->glyphs[i] = current->halfWidthGlyph;
-				p->glyphWidths[i] =
-						current->halfWidthGlyphWidth;
-			} else if (ambiguousWidth == 2 &&
-				   current->fullWidthGlyph != NULL) {
-				p->glyphs[i] = current->fullWidthGlyph;
-				p->glyphWidths[i] =
-						current->fullWidthGlyphWidth;
-			}
+			    current->halfWidthGlyph != UNIFONT_GLYPH_NONE)
+				font_setGlyph(p, i, current->halfWidthGlyph,
+					      current->halfWidthGlyphWidth);
+			else if (ambiguousWidth == 2 &&
+				 current->fullWidthGlyph != UNIFONT_GLYPH_NONE)
+				font_setGlyph(p, i, current->fullWidthGlyph,
+					      current->fullWidthGlyphWidth);
 		} else {
-			if (current->halfWidthGlyph != NULL) {
-				p->glyphs[i] = current->halfWidthGlyph;
-				p->glyphWidths[i] =
-						current->halfWidthGlyphWidth;
-			} else if (current->fullWidthGlyph != NULL) {
-				p->glyphs[i] = current->fullWidthGlyph;
-				p->glyphWidths[i] =
-						current->fullWidthGlyphWidth;
-			}
+			if (current->halfWidthGlyph != UNIFONT_GLYPH_NONE)
+				font_setGlyph(p, i, current->halfWidthGlyph,
+					      current->halfWidthGlyphWidth);
+			else if (current->fullWidthGlyph != UNIFONT_GLYPH_NONE)
+				font_setGlyph(p, i, current->fullWidthGlyph,
+					      current->fullWidthGlyphWidth);
 		}
 	}
 }
@@ -1173,10 +2723,12 @@ static void underlineGlyph_initialize(void)
 
 static void createUnderlineGlyph(void)
 {
-	u_short width, height;
+	u_short width, height, thickness;
 
+	flushRotatedGlyphs();
 	width  = gFontsWidth * 2;
 	height = gFontsHeight;
+	thickness = font.scale < height ? font.scale : height;
 	if ((width % 8) != 0)
 		width = width + (8 - (width % 8));
 	underlineGlyph.bytesPerWidth = width / 8;
@@ -1186,8 +2738,8 @@ static void createUnderlineGlyph(void)
 		err(1, "malloc()");
 	memset(underlineGlyph.glyph, 0x00, underlineGlyph.bytesPerChar);
 	memset(underlineGlyph.glyph + underlineGlyph.bytesPerChar -
-			underlineGlyph.bytesPerWidth,
-	       0xff, underlineGlyph.bytesPerWidth);
+			underlineGlyph.bytesPerWidth * thickness,
+	       0xff, underlineGlyph.bytesPerWidth * thickness);
 }
 
 static void underlineGlyph_finalize(void)
@@ -1200,12 +2752,96 @@ static void underlineGlyph_finalize(void)
 	}
 }
 
+/*
+ * Return glyph turned as gFramebuffer.rotate turns the screen.  Only the
+ * drawn width x height part is rotated, so that the result lines up with
+ * the rectangle given to the accessor.
+ */
+static const u_char *getRotatedGlyph(const u_char *glyph,
+				     u_int bytesPerWidth, u_int width,
+				     u_int height, u_int *rotatedBytesPerWidth)
+{
+	struct rotatedGlyph *r;
+	u_int bucket, x, y, col, row, rows, bytes;
+
+	assert(initialized);
+	assert(glyph != NULL);
+	assert(rotatedBytesPerWidth != NULL);
+
+	bucket = (((uintptr_t)glyph >> 2) ^ (width << 7) ^ height) &
+		 (ROTATED_GLYPH_BUCKETS - 1);
+	for (r = rotatedGlyphs[bucket]; r != NULL; r = r->next) {
+		if (r->glyph == glyph && r->width == width &&
+		    r->height == height) {
+			*rotatedBytesPerWidth = r->bytesPerWidth;
+			return r->bitmap;
+		}
+	}
+
+	if (gFramebuffer.rotate == 180) {
+		rows = height;
+		bytes = (width + 7) / 8;
+	} else {
+		rows = width;
+		bytes = (height + 7) / 8;
+	}
+	r = calloc(1, sizeof(struct rotatedGlyph) + bytes * rows);
+	if (r == NULL)
+		err(1, "calloc()");
+	r->glyph = glyph;
+	r->width = width;
+	r->height = height;
+	r->bytesPerWidth = bytes;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			if (!(glyph[y * bytesPerWidth + (x >> 3)] &
+			      (0x80 >> (x & 7))))
+				continue;
+			switch (gFramebuffer.rotate) {
+			case 90:
+				row = x;
+				col = height - 1 - y;
+				break;
+			case 180:
+				row = height - 1 - y;
+				col = width - 1 - x;
+				break;
+			default:
+				row = width - 1 - x;
+				col = y;
+				break;
+			}
+			r->bitmap[row * r->bytesPerWidth + (col >> 3)] |=
+				0x80 >> (col & 7);
+		}
+	}
+	r->next = rotatedGlyphs[bucket];
+	rotatedGlyphs[bucket] = r;
+	*rotatedBytesPerWidth = r->bytesPerWidth;
+	return r->bitmap;
+}
+
+static void flushRotatedGlyphs(void)
+{
+	struct rotatedGlyph *r, *next;
+	int i;
+
+	for (i = 0; i < ROTATED_GLYPH_BUCKETS; i++) {
+		for (r = rotatedGlyphs[i]; r != NULL; r = next) {
+			next = r->next;
+			free(r);
+		}
+		rotatedGlyphs[i] = NULL;
+	}
+}
+
 void font_draw(TFont *p, uint16_t code, uint8_t foregroundColor,
 	       uint8_t backgroundColor, u_int x, u_int y,
 	       bool underline, bool doubleColumn)
 {
 	u_int fontX, fontY, fontWidth, fontHeight, shadowWidth, shadowHeight;
-	const u_char *glyph;
+	u_int glyphHeight, bytesPerWidth;
+	const u_char *glyph, *bitmap;
 	u_short glyphWidth;
 
 	assert(initialized);
@@ -1222,31 +2858,119 @@ void font_draw(TFont *p, uint16_t code, uint8_t foregroundColor,
 	if (code == 0x00)
 		return;
 	glyph = p->getGlyph(p, code, &glyphWidth);
+	/* a font loaded after the cell size was fixed may be larger */
+	if (glyphWidth > fontWidth)
+		glyphWidth = fontWidth;
+	glyphHeight = (p->height > fontHeight) ? fontHeight : p->height;
 	if (font.effect == FONT_EFFECT_SHADOW &&
-	    glyphWidth > 0 && p->height > 0 && backgroundColor == 0) {
+	    glyphWidth > 0 && glyphHeight > 0 && backgroundColor == 0) {
 		shadowWidth  = (fontWidth > glyphWidth) ?
 			       glyphWidth : glyphWidth - 1;
-		shadowHeight = (fontHeight > p->height) ?
-			       p->height : p->height - 1;
+		shadowHeight = (fontHeight > glyphHeight) ?
+			       glyphHeight : glyphHeight - 1;
+		bitmap = glyph;
+		bytesPerWidth = p->bytesPerWidth;
+		if (gFramebuffer.rotate != 0)
+			bitmap = getRotatedGlyph(glyph, p->bytesPerWidth,
+						 shadowWidth, shadowHeight,
+						 &bytesPerWidth);
 		gFramebuffer.accessor.overlay(&gFramebuffer,
-					      glyph,
-					      p->bytesPerWidth,
+					      bitmap,
+					      bytesPerWidth,
 					      fontX + 1, fontY + 1,
 					      shadowWidth, shadowHeight,
 					      font.shadowColor);
 	}
+	bitmap = glyph;
+	bytesPerWidth = p->bytesPerWidth;
+	if (gFramebuffer.rotate != 0)
+		bitmap = getRotatedGlyph(glyph, p->bytesPerWidth,
+					 glyphWidth, glyphHeight,
+					 &bytesPerWidth);
 	gFramebuffer.accessor.overlay(&gFramebuffer,
-				      glyph,
-				      p->bytesPerWidth,
+				      bitmap,
+				      bytesPerWidth,
 				      fontX, fontY,
-				      glyphWidth, p->height,
+				      glyphWidth, glyphHeight,
 				      foregroundColor);
-	if (underline)
+	if (underline) {
+		bitmap = underlineGlyph.glyph;
+		bytesPerWidth = underlineGlyph.bytesPerWidth;
+		if (gFramebuffer.rotate != 0)
+			bitmap = getRotatedGlyph(underlineGlyph.glyph,
+						 underlineGlyph.bytesPerWidth,
+						 fontWidth, fontHeight,
+						 &bytesPerWidth);
 		gFramebuffer.accessor.overlay(&gFramebuffer,
-					      underlineGlyph.glyph,
-					      underlineGlyph.bytesPerWidth,
+					      bitmap,
+					      bytesPerWidth,
 					      fontX, fontY,
 					      fontWidth, fontHeight,
 					      foregroundColor);
+	}
 }
 
+/* overlay the scanlines of glyph from top down */
+static void overlayRows(const u_char *glyph, u_int bytesPerWidth,
+			u_int x, u_int y, u_int width, u_int height,
+			u_int top, uint8_t color)
+{
+	const u_char *bitmap;
+	u_int rotatedBytesPerWidth;
+
+	if (width == 0 || height <= top)
+		return;
+	bitmap = glyph + bytesPerWidth * top;
+	rotatedBytesPerWidth = bytesPerWidth;
+	if (gFramebuffer.rotate != 0)
+		bitmap = getRotatedGlyph(bitmap, bytesPerWidth,
+					 width, height - top,
+					 &rotatedBytesPerWidth);
+	gFramebuffer.accessor.overlay(&gFramebuffer,
+				      bitmap,
+				      rotatedBytesPerWidth,
+				      x, y + top,
+				      width, height - top,
+				      color);
+}
+
+/*
+ * Draw the bottom height scanlines of a cell as a cursor: the glyph in
+ * the background color on the cursor color.  Nothing is read back from
+ * the framebuffer, unlike with the reverse accessor.
+ */
+void font_drawCursor(TFont *p, uint16_t code, uint8_t cursorColor,
+		     uint8_t backgroundColor, u_int x, u_int y,
+		     bool underline, bool doubleColumn, u_int height)
+{
+	u_int fontX, fontY, fontWidth, fontHeight, glyphHeight, top;
+	const u_char *glyph;
+	u_short glyphWidth;
+
+	assert(initialized);
+	assert(p != NULL);
+
+	fontX = gFontsWidth * x;
+	fontY = gFontsHeight * y;
+	fontWidth = doubleColumn ? gFontsWidth * 2 : gFontsWidth;
+	fontHeight = gFontsHeight;
+	if (height > fontHeight)
+		height = fontHeight;
+	top = fontHeight - height;
+	gFramebuffer.accessor.fill(&gFramebuffer,
+				   fontX, fontY + top,
+				   fontWidth, height,
+				   cursorColor);
+	if (code == 0x00)
+		return;
+	glyph = p->getGlyph(p, code, &glyphWidth);
+	if (glyphWidth > fontWidth)
+		glyphWidth = fontWidth;
+	glyphHeight = (p->height > fontHeight) ? fontHeight : p->height;
+	overlayRows(glyph, p->bytesPerWidth, fontX, fontY,
+		    glyphWidth, glyphHeight, top, backgroundColor);
+	if (underline)
+		overlayRows(underlineGlyph.glyph, underlineGlyph.bytesPerWidth,
+			    fontX, fontY, fontWidth, fontHeight, top,
+			    backgroundColor);
+}
@@ -45,6 +45,19 @@
 #define FONT_SIGNATURE_96CHAR  (0x02000000)           /* 96 or 96^n */
 #define FONT_SIGNATURE_OTHER   (0x10000000)           /* other coding system */
 
+/*
+ * Glyphs are found through a two level directory of 32 bit offsets.
+ * An offset is into the bitmap, or into extra if FONT_GLYPH_EXTRA is set.
+ * extra starts with the default glyph, so pages of default glyphs share
+ * one static page.  Widths are 8 bit indexes into widths[], which holds
+ * as many widths as any font of up to FONT_WIDTHS pixels can have.
+ */
+#define FONT_GLYPH_PAGE_SHIFT (6)
+#define FONT_GLYPH_PAGE       (1 << FONT_GLYPH_PAGE_SHIFT)
+#define FONT_GLYPH_EXTRA      (0x80000000)
+#define FONT_GLYPH_DEFAULT    (FONT_GLYPH_EXTRA | 0)
+#define FONT_WIDTHS           (256)
+
 typedef enum {
 	FONT_HALF_LEFT,
 	FONT_HALF_RIGHT,
@@ -55,15 +68,25 @@ typedef struct Raw_TFont {
 	const u_char *(*getGlyph)(struct Raw_TFont *p, uint16_t code,
 				  u_short *width);
 	const char *name;
+	char *path;
 	u_short width;
 	u_short height;
 	u_int signature;
 	FONT_HALF half;
 	bool alias;
-	u_char **glyphs;
-	u_short *glyphWidths;
-	u_char *defaultGlyph;
+	struct Raw_TFont *aliasOf;
+	uint32_t **glyphPages;
+	u_char *glyphWidths;
+	u_short widths[FONT_WIDTHS];
+	u_short nWidths;
+	bool widthsOverflow;
+	u_char *extra;
+	size_t extraSize;
 	u_char *bitmap;
+	size_t bitmapSize;
+	u_char *image;
+	size_t imageSize;
+	bool imageMapped;
 	u_int colf;
 	u_int coll;
 	u_int rowf;
@@ -83,10 +106,16 @@ void font_showList(FILE *stream);
 int font_getIndexBySignature(const u_int signature);
 int font_getIndexByName(const char *name);
 bool font_isLoaded(TFont *p);
+void font_load(TFont *p);
+void font_allocateGlyphs(TFont *p, bool hasWidths);
+void font_setGlyph(TFont *p, u_int index, uint32_t offset, u_short width);
 void font_unifontGlyph(TFont *p, int ambiguousWidth);
 void font_draw(TFont *p, uint16_t code, uint8_t foregroundColor,
 	       uint8_t backgroundColor, u_int x, u_int y,
 	       bool underline, bool doubleColumn);
+void font_drawCursor(TFont *p, uint16_t code, uint8_t cursorColor,
+		     uint8_t backgroundColor, u_int x, u_int y,
+		     bool underline, bool doubleColumn, u_int height);
 
 #endif /* INCLUDE_FONT_H */
 
@@ -50,6 +50,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #if defined (__linux__)
 #include <sys/sysmacros.h>
@@ -90,6 +93,15 @@ TFrameBuffer gFramebuffer;
 
 static TFrameBuffer *const self = &gFramebuffer;
 static bool initialized;
+/* the accessor of the device, wrapped when the screen is rotated */
+static TFrameBufferAccessor deviceAccessor;
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Held by whoever draws, so that the render thread and the event loop
+ * never draw at once.  Recursive, as drawing the cells calls cursor_show().
+ */
+static pthread_mutex_t drawLock;
+#endif
 
 #if defined (__linux__)
 static const TFrameBufferAccessor accessors[] = {
@@ -337,6 +349,16 @@ static void configVideoMode(const char *config);
 static void configWriteCombineMode(const char *config);
 static void configWriteCombineBase(const char *config);
 static void configWriteCombineSize(const char *config);
+static void configRotate(const char *config);
+static bool rotateRectangle(u_int *sx, u_int *sy, u_int *ex, u_int *ey,
+			    bool clip);
+static void rotatedFill(TFrameBuffer *p, u_int sx, u_int sy,
+			u_int ex, u_int ey, uint8_t color);
+static void rotatedOverlay(TFrameBuffer *p, const u_char *bitmap,
+			   u_int bytesPerWidth, u_int sx, u_int sy,
+			   u_int ex, u_int ey, uint8_t color);
+static void rotatedReverse(TFrameBuffer *p, u_int sx, u_int sy,
+			   u_int ex, u_int ey, uint8_t color);
 #if defined (__linux__)
 static void getVariableScreenInfo(struct fb_var_screeninfo *fb_var_screeninfo);
 static void setVariableScreenInfo(struct fb_var_screeninfo *fb_var_screeninfo);
@@ -384,16 +406,28 @@ void framebuffer_initialize(void)
 	int fd;
 	struct fb_con2fbmap c2m;
 #endif
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutexattr_t attr;
+#endif
 
 	assert(!initialized);
 
 	atexit(finalizer);
 	initialized = true;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&drawLock, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
 	self->device[0] = '\0';
 	self->fd = -1;
 	self->height = 0;
 	self->width = 0;
 	self->bytesPerLine = 0;
+	self->rotate = 0;
+	self->screenHeight = 0;
+	self->screenWidth = 0;
 	self->offset = 0;
 	self->length = 0;
 	self->memory = MAP_FAILED;
@@ -558,6 +592,23 @@ static void configWriteCombineSize(const char *config)
 	}
 }
 
+static void configRotate(const char *config)
+{
+	int rotate;
+
+	assert(initialized);
+
+	self->rotate = 0;
+	if (config != NULL) {
+		rotate = atoi(config);
+		if (rotate == 0 || rotate == 90 || rotate == 180 ||
+		    rotate == 270)
+			self->rotate = rotate;
+		else
+			warnx("Invalid video rotation: %s", config);
+	}
+}
+
 void framebuffer_configure(TCaps *caps)
 {
 	const char *config;
@@ -575,6 +626,81 @@ void framebuffer_configure(TCaps *caps)
 	configWriteCombineBase(config);
 	config = caps_findFirst(caps, "writecombine.size");
 	configWriteCombineSize(config);
+	config = caps_findFirst(caps, "video.rotate");
+	configRotate(config);
+}
+
+/*
+ * Map a rectangle of the rotated screen onto the device.  A rectangle
+ * outside of the screen is clipped, or refused if clip is false, as a
+ * clipped bitmap would no longer line up with the rectangle.
+ */
+static bool rotateRectangle(u_int *sx, u_int *sy, u_int *ex, u_int *ey,
+			    bool clip)
+{
+	u_int x, y, w, h;
+
+	assert(initialized);
+
+	if (*sx >= self->screenWidth || *sy >= self->screenHeight)
+		return false;
+	if (*ex > self->screenWidth - *sx || *ey > self->screenHeight - *sy) {
+		if (!clip)
+			return false;
+		if (*ex > self->screenWidth - *sx)
+			*ex = self->screenWidth - *sx;
+		if (*ey > self->screenHeight - *sy)
+			*ey = self->screenHeight - *sy;
+	}
+	x = *sx;
+	y = *sy;
+	w = *ex;
+	h = *ey;
+	switch (self->rotate) {
+	case 90:
+		*sx = self->width - y - h;
+		*sy = x;
+		*ex = h;
+		*ey = w;
+		break;
+	case 180:
+		*sx = self->width - x - w;
+		*sy = self->height - y - h;
+		break;
+	case 270:
+		*sx = y;
+		*sy = self->height - x - w;
+		*ex = h;
+		*ey = w;
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+static void rotatedFill(TFrameBuffer *p, u_int sx, u_int sy,
+			u_int ex, u_int ey, uint8_t color)
+{
+	if (rotateRectangle(&sx, &sy, &ex, &ey, true))
+		deviceAccessor.fill(p, sx, sy, ex, ey, color);
+}
+
+/* bitmap is already rotated, see font_draw() */
+static void rotatedOverlay(TFrameBuffer *p, const u_char *bitmap,
+			   u_int bytesPerWidth, u_int sx, u_int sy,
+			   u_int ex, u_int ey, uint8_t color)
+{
+	if (rotateRectangle(&sx, &sy, &ex, &ey, false))
+		deviceAccessor.overlay(p, bitmap, bytesPerWidth,
+				       sx, sy, ex, ey, color);
+}
+
+static void rotatedReverse(TFrameBuffer *p, u_int sx, u_int sy,
+			   u_int ex, u_int ey, uint8_t color)
+{
+	if (rotateRectangle(&sx, &sy, &ex, &ey, true))
+		deviceAccessor.reverse(p, sx, sy, ex, ey, color);
 }
 
 #if defined (__linux__)
@@ -1136,6 +1262,21 @@ void framebuffer_open(void)
 	#error not implement
 #endif
 
+	/* Rotation */
+	deviceAccessor = self->accessor;
+	if (self->rotate == 90 || self->rotate == 270) {
+		self->screenWidth = self->height;
+		self->screenHeight = self->width;
+	} else {
+		self->screenWidth = self->width;
+		self->screenHeight = self->height;
+	}
+	if (self->rotate != 0) {
+		self->accessor.fill = rotatedFill;
+		self->accessor.overlay = rotatedOverlay;
+		self->accessor.reverse = rotatedReverse;
+	}
+
 	/* Memory mapping */
 	/* Same as getpagesize(3) */
 	pageMask = sysconf(_SC_PAGESIZE) - 1;
@@ -1226,6 +1367,20 @@ void framebuffer_reset(void)
 	}
 }
 
+void framebuffer_lock(void)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&drawLock);
+#endif
+}
+
+void framebuffer_unlock(void)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&drawLock);
+#endif
+}
+
 #if defined (__linux__)
 static int getAccessorIndex(struct fb_var_screeninfo *fb_var_screeninfo,
 			    struct fb_fix_screeninfo *fb_fix_screeninfo)
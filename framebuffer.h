@@ -86,6 +86,9 @@ typedef struct Raw_TFrameBuffer {
 	u_int height;                 /* height */
 	u_int width;                  /* width */
 	u_int bytesPerLine;           /* bytes per line */
+	u_int rotate;                 /* clockwise rotation in degrees */
+	u_int screenHeight;           /* height as seen after rotation */
+	u_int screenWidth;            /* width as seen after rotation */
 	/* memory */
 	u_long offset;
 	u_long length;
@@ -115,6 +118,8 @@ void framebuffer_setColorMap(struct wsdisplay_cmap *cmap);
 bool framebuffer_setBlank(const int blank);
 void framebuffer_open(void);
 void framebuffer_reset(void);
+void framebuffer_lock(void);
+void framebuffer_unlock(void);
 
 #endif /* INCLUDE_FRAMEBUFFER_H */
 
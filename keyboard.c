@@ -31,6 +31,7 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 #include <assert.h>
 #include <err.h>
 #include <stdbool.h>
@@ -75,6 +76,20 @@ static struct {
 	0
 };
 
+/*
+ * LED and modifier state.  keyboard_updateState() reads it when a key or
+ * mouse event arrives, and keyboard_pollState() at most every
+ * KEYBOARD_POLL_INTERVAL msec. while the pty is busy, so the output path
+ * asks the cache instead of issuing keyboard ioctls on every read.
+ */
+#define KEYBOARD_POLL_INTERVAL (100)
+
+static struct {
+	bool scrollLocked;
+	int shiftState;
+	struct timeval timer;
+} state;
+
 static bool repeatDataSaved;
 static bool initialized;
 
@@ -128,6 +143,7 @@ void keyboard_initialize(void)
 #else
 	#error not implement
 #endif
+	keyboard_updateState();
 }
 
 static void finalize(void)
@@ -288,52 +304,70 @@ static void setKeyRepeat(const int delay, const int repeat)
 #endif
 }
 
-bool keyboard_isScrollLocked(void)
+void keyboard_updateState(void)
 {
 #if defined (__linux__)
-	bool result;
 	int kbled;
+	char shift_state;
 
 	assert(initialized);
 
-	result = false;
+	state.scrollLocked = false;
 	if (ioctl(STDIN_FILENO, KDGKBLED, &kbled) != -1)
-		result = (kbled & K_SCROLLLOCK);
-	return result;
+		state.scrollLocked = (kbled & K_SCROLLLOCK);
+	state.shiftState = 0;
+	shift_state = 6;
+	if (ioctl(STDIN_FILENO, TIOCLINUX, &shift_state) != -1)
+		state.shiftState = shift_state;
 #elif defined (__FreeBSD__)
-	bool result;
 	int kbstate;
 
 	assert(initialized);
 
-	result = false;
+	state.scrollLocked = false;
 	if (ioctl(STDIN_FILENO, KDGKBSTATE, &kbstate) != -1)
-		result = (kbstate & SLKED);
-	return result;
+		state.scrollLocked = (kbstate & SLKED);
 #elif defined (__NetBSD__) || defined (__OpenBSD__)
-	bool result;
 	int led;
 
 	assert(initialized);
 
-	result = false;
+	state.scrollLocked = false;
 	if (ioctl(STDIN_FILENO, WSKBDIO_GETLEDS, &led) != -1)
-		result = (led & WSKBD_LED_SCROLL);
-	return result;
+		state.scrollLocked = (led & WSKBD_LED_SCROLL);
 #else
 	#error not implement
 #endif
+	gettimeofday(&(state.timer), NULL);
+}
+
+/* Scroll Lock has no input event, so the busy output path looks for it */
+void keyboard_pollState(void)
+{
+	struct timeval now, diff;
+	long elapsedTime;
+
+	assert(initialized);
+
+	timerclear(&diff);
+	gettimeofday(&now, NULL);
+	timersub(&now, &(state.timer), &diff);
+	elapsedTime = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	if (elapsedTime < 0 || elapsedTime >= KEYBOARD_POLL_INTERVAL)
+		keyboard_updateState();
+}
+
+bool keyboard_isScrollLocked(void)
+{
+	assert(initialized);
+
+	return state.scrollLocked;
 }
 
 bool keyboard_isShiftPressed(void)
 {
 #if defined (__linux__)
-	char shift_state;
-
-	shift_state = 6;
-	if (ioctl(STDIN_FILENO, TIOCLINUX, &shift_state) == -1)
-		return false;
-	return (shift_state & (1 << KG_SHIFT));
+	return (state.shiftState & (1 << KG_SHIFT));
 #else
 	return false;
 #endif
@@ -342,12 +376,7 @@ bool keyboard_isShiftPressed(void)
 bool keyboard_isAltPressed(void)
 {
 #if defined (__linux__)
-	char shift_state;
-
-	shift_state = 6;
-	if (ioctl(STDIN_FILENO, TIOCLINUX, &shift_state) == -1)
-		return false;
-	return (shift_state & (1 << KG_ALT));
+	return (state.shiftState & (1 << KG_ALT));
 #else
 	return false;
 #endif
@@ -356,14 +385,8 @@ bool keyboard_isAltPressed(void)
 bool keyboard_isCtrlPressed(void)
 {
 #if defined (__linux__)
-	char shift_state;
-
-	shift_state = 6;
-	if (ioctl(STDIN_FILENO, TIOCLINUX, &shift_state) == -1)
-		return false;
-	return (shift_state & (1 << KG_CTRL));
+	return (state.shiftState & (1 << KG_CTRL));
 #else
 	return false;
 #endif
 }
-
@@ -37,6 +37,8 @@ void keyboard_configure(TCaps *caps);
 #if defined (__linux__)
 void keyboard_enableScrollBack(bool enable);
 #endif
+void keyboard_updateState(void);
+void keyboard_pollState(void);
 bool keyboard_isScrollLocked(void);
 bool keyboard_isShiftPressed(void);
 bool keyboard_isAltPressed(void);
@@ -84,6 +84,15 @@ static struct {
 	char obutton;
 } mouseInfo;
 
+/*
+ * Motion is summed over a read and acted on once, so that a fast mouse
+ * costs one selection update, tracking report and cursor redraw per read.
+ */
+static struct {
+	int dx, dy;             /* pixels not yet made into cells */
+	bool pending;
+} motion;
+
 typedef enum {
 	MOUSE_TYPE_MICROSOFT,
 	MOUSE_TYPE_MOUSESYSTEMS,
@@ -144,7 +153,8 @@ static void analyzePacket(TVterm *p, const u_char *packet);
 #if defined (__NetBSD__) || defined (__OpenBSD__)
 static void analyzeWSConsEvents(TVterm *p);
 #endif
-static void execute(TVterm *p, int *dx, int *dy);
+static void flushMotion(TVterm *p);
+static void execute(TVterm *p);
 static void getSelectionRegion(int *sx, int *sy, int *ex, int *ey);
 static bool isMouseButtonDown(char button);
 static bool isMouseButtonMove(char button);
@@ -449,6 +459,23 @@ bool mouse_isTimeout(void)
 	return elapsedTime >= MOUSE_LIFETIME;
 }
 
+/* msec. until mouse_isTimeout() becomes true */
+int mouse_getTimeout(void)
+{
+	struct timeval now, diff;
+	long elapsedTime;
+
+	assert(initialized);
+
+	timerclear(&diff);
+	gettimeofday(&now, NULL);
+	timersub(&now, &mouse.timer, &diff);
+	elapsedTime = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	if (elapsedTime >= MOUSE_LIFETIME * 100L)
+		return 0;
+	return MOUSE_LIFETIME * 100L - elapsedTime;
+}
+
 int mouse_getX(void)
 {
 	assert(initialized);
@@ -588,19 +615,21 @@ void mouse_stop(void)
 
 static void analyzePacket(TVterm *p, const u_char *packet)
 {
-	static int dx, dy;
-	int dz;
+	int dx, dy, dz;
+	char button;
 
 	assert(initialized);
 	assert(p != NULL);
 	assert(packet != NULL);
 
+	dx = 0;
+	dy = 0;
 	dz = 0;
-	mouseInfo.button = MOUSE_BUTTON_NONE;
+	button = MOUSE_BUTTON_NONE;
 	switch (mouse.type) {
 	case MOUSE_TYPE_MICROSOFT:
-		mouseInfo.button |= ((packet[0] & 0x20) >> 5);
-		mouseInfo.button |= ((packet[0] & 0x10) >> 2);
+		button |= ((packet[0] & 0x20) >> 5);
+		button |= ((packet[0] & 0x10) >> 2);
 		dx += (char)(((packet[0] & 0x03) << 6) | (packet[1] & 0x3f));
 		dy += (char)(((packet[0] & 0x0c) << 4) | (packet[2] & 0x3f));
 		break;
@@ -609,59 +638,59 @@ static void analyzePacket(TVterm *p, const u_char *packet)
 		/* FALLTHROUGH */
 #endif
 	case MOUSE_TYPE_MOUSESYSTEMS:
-		mouseInfo.button |= ((~packet[0] & 0x04) >> 2);
-		mouseInfo.button |= ((~packet[0] & 0x02));
-		mouseInfo.button |= ((~packet[0] & 0x01) << 2);
+		button |= ((~packet[0] & 0x04) >> 2);
+		button |= ((~packet[0] & 0x02));
+		button |= ((~packet[0] & 0x01) << 2);
 		dx +=  ((char)(packet[1]) + (char)(packet[3]));
 		dy += -((char)(packet[2]) + (char)(packet[4]));
 		if (mouse.packetSize >= 8) {
 			dz = ((char)(packet[5] << 1) +
 			      (char)(packet[6] << 1)) >> 1;
 #if 0
-			mouseInfo.button |= ((~packet[7] & 0x03) << 3);
+			button |= ((~packet[7] & 0x03) << 3);
 #endif
 		}
 		break;
 	case MOUSE_TYPE_BUSMOUSE:
-		mouseInfo.button |= ((~packet[0] & 0x04) >> 2);
-		mouseInfo.button |= ((~packet[0] & 0x02));
-		mouseInfo.button |= ((~packet[0] & 0x01) << 2);
+		button |= ((~packet[0] & 0x04) >> 2);
+		button |= ((~packet[0] & 0x02));
+		button |= ((~packet[0] & 0x01) << 2);
 		dx +=  (char)packet[1];
 		dy += -(char)packet[2];
 		break;
 	case MOUSE_TYPE_MMSERIES:
 		/* FALLTHROUGH */
 	case MOUSE_TYPE_LOGITECH:
-		mouseInfo.button |= ((packet[0] & 0x04) >> 2);
-		mouseInfo.button |= ((packet[0] & 0x02));
-		mouseInfo.button |= ((packet[0] & 0x01) << 2);
+		button |= ((packet[0] & 0x04) >> 2);
+		button |= ((packet[0] & 0x02));
+		button |= ((packet[0] & 0x01) << 2);
 		dx += (packet[0] & 0x10) ? packet[1] : -packet[1];
 		dy += (packet[0] & 0x08) ? -packet[2] : packet[2];
 		break;
 	case MOUSE_TYPE_PS2:
-		mouseInfo.button |= ((packet[0] & 0x01));
-		mouseInfo.button |= ((packet[0] & 0x04) >> 1);
-		mouseInfo.button |= ((packet[0] & 0x02) << 1);
+		button |= ((packet[0] & 0x01));
+		button |= ((packet[0] & 0x04) >> 1);
+		button |= ((packet[0] & 0x02) << 1);
 		dx += (char)(packet[1]);
 		dy -= (char)(packet[2]);
 		break;
 	case MOUSE_TYPE_IMPS2:
-		mouseInfo.button |= ((packet[0] & 0x01));
-		mouseInfo.button |= ((packet[0] & 0x04) >> 1);
-		mouseInfo.button |= ((packet[0] & 0x02) << 1);
+		button |= ((packet[0] & 0x01));
+		button |= ((packet[0] & 0x04) >> 1);
+		button |= ((packet[0] & 0x02) << 1);
 		dx += (char)(packet[1]);
 		dy -= (char)(packet[2]);
 		dz  = (char)(packet[3]);
 		break;
 	case MOUSE_TYPE_EXPS2:
-		mouseInfo.button |= ((packet[0] & 0x01));
-		mouseInfo.button |= ((packet[0] & 0x04) >> 1);
-		mouseInfo.button |= ((packet[0] & 0x02) << 1);
+		button |= ((packet[0] & 0x01));
+		button |= ((packet[0] & 0x04) >> 1);
+		button |= ((packet[0] & 0x02) << 1);
 		dx += (char)(packet[1]);
 		dy -= (char)(packet[2]);
 #if 0
-		mouseInfo.button |= ((packet[3] & 0x10) >> 1);
-		mouseInfo.button |= ((packet[3] & 0x20) >> 1);
+		button |= ((packet[3] & 0x10) >> 1);
+		button |= ((packet[3] & 0x20) >> 1);
 #endif
 		dz  = (char)((packet[3] & 0x0f) << 4) >> 4;
 		break;
@@ -670,6 +699,16 @@ static void analyzePacket(TVterm *p, const u_char *packet)
 	default:
 		return;
 	}
+	/* buttons and the wheel act where the motion before them ended */
+	if (button != mouseInfo.button || dz != 0)
+		flushMotion(p);
+	motion.dx += dx;
+	motion.dy += dy;
+	if (button == mouseInfo.button && dz == 0) {
+		motion.pending = true;
+		return;
+	}
+	mouseInfo.button = button;
 	if (dz < 0) {
 		mouseInfo.obutton &= ~MOUSE_BUTTON_MB4;
 		mouseInfo.button  |=  MOUSE_BUTTON_MB4;
@@ -678,13 +717,12 @@ static void analyzePacket(TVterm *p, const u_char *packet)
 		mouseInfo.obutton &= ~MOUSE_BUTTON_MB5;
 		mouseInfo.button  |=  MOUSE_BUTTON_MB5;
 	}
-	execute(p, &dx, &dy);
+	execute(p);
 }
 
 #if defined (__NetBSD__) || defined (__OpenBSD__)
 static void analyzeWSConsEvents(TVterm *p)
 {
-	static int dx, dy;
 	int dz;
 	struct wscons_event wscons_event;
 	ssize_t nbytes;
@@ -697,9 +735,11 @@ static void analyzeWSConsEvents(TVterm *p)
 			      sizeof(struct wscons_event));
 		if (nbytes != sizeof(struct wscons_event))
 			break;
+		/* buttons and the wheel act where the motion before them ended */
 		dz = 0;
 		switch (wscons_event.type) {
 		case WSCONS_EVENT_MOUSE_UP:
+			flushMotion(p);
 			switch (wscons_event.value) {
 			case 0:
 				mouseInfo.button &= ~MOUSE_BUTTON_MB1;
@@ -713,6 +753,7 @@ static void analyzeWSConsEvents(TVterm *p)
 			}
 			break;
 		case WSCONS_EVENT_MOUSE_DOWN:
+			flushMotion(p);
 			switch (wscons_event.value) {
 			case 0:
 				mouseInfo.button |= MOUSE_BUTTON_MB1;
@@ -726,12 +767,15 @@ static void analyzeWSConsEvents(TVterm *p)
 			}
 			break;
 		case WSCONS_EVENT_MOUSE_DELTA_X:
-			dx += wscons_event.value;
-			break;
+			motion.dx += wscons_event.value;
+			motion.pending = true;
+			continue;
 		case WSCONS_EVENT_MOUSE_DELTA_Y:
-			dy -= wscons_event.value;
-			break;
+			motion.dy -= wscons_event.value;
+			motion.pending = true;
+			continue;
 		case WSCONS_EVENT_MOUSE_DELTA_Z:
+			flushMotion(p);
 			dz  = wscons_event.value;
 			break;
 		default:
@@ -745,25 +789,34 @@ static void analyzeWSConsEvents(TVterm *p)
 			mouseInfo.obutton &= ~MOUSE_BUTTON_MB5;
 			mouseInfo.button  |=  MOUSE_BUTTON_MB5;
 		}
-		execute(p, &dx, &dy);
+		execute(p);
 	}
+	flushMotion(p);
 }
 #endif
 
-static void execute(TVterm *p, int *dx, int *dy)
+static void flushMotion(TVterm *p)
+{
+	assert(initialized);
+	assert(p != NULL);
+
+	if (motion.pending)
+		execute(p);
+}
+
+static void execute(TVterm *p)
 {
 	assert(initialized);
 	assert(p != NULL);
-	assert(dx != NULL);
-	assert(dy != NULL);
 
+	motion.pending = false;
 	if (!mouse.enable)
 		return;
 	resetTimer();
-	mouseInfo.dx = *dx / (int)gFontsWidth;
-	*dx -= mouseInfo.dx * (int)gFontsWidth;
-	mouseInfo.dy = *dy / (int)gFontsHeight;
-	*dy -= mouseInfo.dy * (int)gFontsHeight;
+	mouseInfo.dx = motion.dx / (int)gFontsWidth;
+	motion.dx -= mouseInfo.dx * (int)gFontsWidth;
+	mouseInfo.dy = motion.dy / (int)gFontsHeight;
+	motion.dy -= mouseInfo.dy * (int)gFontsHeight;
 	if (mouseInfo.dx != 0 || mouseInfo.dy != 0) {
 		mouseInfo.x += mouseInfo.dx;
 		mouseInfo.y += mouseInfo.dy;
@@ -850,24 +903,25 @@ static void selection(TVterm *p)
 		if (p->cursor) {
 			strncpy(buf, "\033OA", sizeof(buf));
 			buf[sizeof(buf) - 1] = '\0';
-			write_wrapper(p->term->masterPty, buf, strlen(buf));
+			term_write(buf, strlen(buf));
 		} else
 			vterm_scroll_backward_line(p);
 	} else if (isMouseButtonDown(MOUSE_BUTTON_MB5)) {
 		if (p->cursor) {
 			strncpy(buf, "\033OB", sizeof(buf));
 			buf[sizeof(buf) - 1] = '\0';
-			write_wrapper(p->term->masterPty, buf, strlen(buf));
+			term_write(buf, strlen(buf));
 		} else
 			vterm_scroll_forward_line(p);
 	} else if (isMouseButtonUp(MOUSE_BUTTON_MB1)) {
 		getSelectionRegion(&sx, &sy, &ex, &ey);
 		vterm_copyText(p, sx, sy, ex, ey);
+		vterm_clearSelection(p);
+		vterm_requestRefresh(p);
 	} else if (isMouseButtonMove(MOUSE_BUTTON_MB1)) {
 		getSelectionRegion(&sx, &sy, &ex, &ey);
-		vterm_reverseText(p, sx, sy, ex, ey);
-		vterm_refresh(p);
-		vterm_reverseText(p, sx, sy, ex, ey);
+		vterm_setSelection(p, sx, sy, ex, ey);
+		vterm_requestRefresh(p);
 	}
 }
 
@@ -895,7 +949,7 @@ static void mouseTrackingX10(TVterm *p)
 	y = mouseInfo.y + 1;
 	if (y > 255 - 32) y = 255 - 32;
 	snprintf(buf, sizeof(buf), "\033[M%c%c%c", b + 32, x + 32, y + 32);
-	write_wrapper(p->term->masterPty, buf, strlen(buf));
+	term_write(buf, strlen(buf));
 }
 
 static void mouseTrackingVT200(TVterm *p)
@@ -932,7 +986,7 @@ static void mouseTrackingVT200(TVterm *p)
 	y = mouseInfo.y + 1;
 	if (y > 255 - 32) y = 255 - 32;
 	snprintf(buf, sizeof(buf), "\033[M%c%c%c", b + 32, x + 32, y + 32);
-	write_wrapper(p->term->masterPty, buf, strlen(buf));
+	term_write(buf, strlen(buf));
 }
 
 static void mouseTrackingButtonEvents(TVterm *p)
@@ -975,7 +1029,7 @@ static void mouseTrackingButtonEvents(TVterm *p)
 	y = mouseInfo.y + 1;
 	if (y > 255 - 32) y = 255 - 32;
 	snprintf(buf, sizeof(buf), "\033[M%c%c%c", b + 32, x + 32, y + 32);
-	write_wrapper(p->term->masterPty, buf, strlen(buf));
+	term_write(buf, strlen(buf));
 }
 
 static void mouseTrackingAnyEvents(TVterm *p)
@@ -1021,7 +1075,7 @@ static void mouseTrackingAnyEvents(TVterm *p)
 	y = mouseInfo.y + 1;
 	if (y > 255 - 32) y = 255 - 32;
 	snprintf(buf, sizeof(buf), "\033[M%c%c%c", b + 32, x + 32, y + 32);
-	write_wrapper(p->term->masterPty, buf, strlen(buf));
+	term_write(buf, strlen(buf));
 }
 
 void mouse_getPackets(TVterm *p)
@@ -1065,6 +1119,7 @@ void mouse_getPackets(TVterm *p)
 				packetSize = 0;
 			}
 		}
+		flushMotion(p);
 	}
 }
 
@@ -43,6 +43,7 @@ void mouse_configure(TCaps *caps);
 int mouse_getFd(void);
 bool mouse_isEnable(void);
 bool mouse_isTimeout(void);
+int mouse_getTimeout(void);
 int mouse_getX(void);
 int mouse_getY(void);
 void mouse_start(void);
@@ -36,6 +36,7 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <err.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -65,158 +66,186 @@
 #define PCF_BDF_ACCELERATORS   (1 << 8)
 
 #define PCF_PROP_SIZE          (4 + 1 + 4)
+#define PCF_TABLE_SIZE         (4 + 4 + 4 + 4)
+#define PCF_METRIC_SIZE        (2 * 6)
+#define PCF_COMPRESSED_METRIC_SIZE (5)
 #define NO_SUCH_CHAR           (-1)
 
-static void unexpectedEOF(void);
-static uint8_t readUINT8(FILE *stream, size_t *position);
-static uint16_t readUINT16LE(FILE *stream, size_t *position);
-static uint16_t readUINT16BE(FILE *stream, size_t *position);
-static uint16_t readUINT16(FILE *stream, TPcfFormat *format, size_t *position);
-static uint32_t readUINT32LE(FILE *stream, size_t *position);
-static uint32_t readUINT32BE(FILE *stream, size_t *position);
-static uint32_t readUINT32(FILE *stream, TPcfFormat *format, size_t *position);
-static void pcfFormat_load(TPcfFormat *p, FILE *stream, size_t *position);
-static void pcfTable_load(TPcfTable *p, FILE *stream, size_t *position);
+typedef struct Raw_TPcfReader {
+	FILE *stream;
+	u_char *image;
+	size_t size;
+	size_t position;
+	jmp_buf error;
+} TPcfReader;
+
+static void pcfError(TPcfReader *reader, const char *format, ...);
+static void checkCount(TPcfReader *reader, uint32_t n, size_t size);
+static void readBytes(TPcfReader *reader, void *buf, size_t nbytes);
+static uint8_t readUINT8(TPcfReader *reader);
+static uint16_t readUINT16LE(TPcfReader *reader);
+static uint16_t readUINT16BE(TPcfReader *reader);
+static uint16_t readUINT16(TPcfReader *reader, TPcfFormat *format);
+static uint32_t readUINT32LE(TPcfReader *reader);
+static uint32_t readUINT32BE(TPcfReader *reader);
+static uint32_t readUINT32(TPcfReader *reader, TPcfFormat *format);
+static void pcfFormat_load(TPcfFormat *p, TPcfReader *reader);
+static void pcfTable_load(TPcfTable *p, TPcfReader *reader);
 #ifdef PCF_DEBUG
 static void pcfTable_debug(TPcfTable *p);
 #endif
-static void pcfProp_load(TPcfProp *p, FILE *stream, TPcfFormat *format,
-			 size_t *position);
+static void pcfProp_load(TPcfProp *p, TPcfReader *reader, TPcfFormat *format);
 static void pcfProperties_initialize(TPcfProperties *p);
 static void pcfProperties_finalize(TPcfProperties *p);
-static void pcfProperties_load(TPcfProperties *p, FILE *stream,
-			       size_t *position);
+static void pcfProperties_load(TPcfProperties *p, TPcfReader *reader);
 #ifdef PCF_DEBUG
 static void pcfProperties_debug(TPcfProperties *p);
 #endif
-static void pcfMetric_load(TPcfMetric *p, FILE *stream, TPcfFormat *format,
-			   size_t *position);
-static void pcfMetric_load_compressed(TPcfMetric *p, FILE *stream,
-				      size_t *position);
+static void pcfMetric_load(TPcfMetric *p, TPcfReader *reader, TPcfFormat *format);
+static void pcfMetric_load_compressed(TPcfMetric *p, TPcfReader *reader);
 #ifdef PCF_DEBUG
 static void pcfMetric_debug(TPcfMetric *p);
 #endif
 static void pcfMetrics_initialize(TPcfMetrics *p);
 static void pcfMetrics_finalize(TPcfMetrics *p);
-static void pcfMetrics_load(TPcfMetrics *p, FILE *stream, size_t *position);
-static void pcfAccelerators_load(TPcfAccelerators *p, FILE *stream,
-				 size_t *position);
+static void pcfMetrics_load(TPcfMetrics *p, TPcfReader *reader);
+static void pcfAccelerators_load(TPcfAccelerators *p, TPcfReader *reader);
 #ifdef PCF_DEBUG
 static void pcfAccelerators_debug(TPcfAccelerators *p);
 #endif
 static void pcfBitmaps_initialize(TPcfBitmaps *p);
 static void pcfBitmaps_finalize(TPcfBitmaps *p);
 static void pcfBitmaps_swap(TPcfBitmaps *p, TPcfFormat *format);
-static void pcfBitmaps_load(TPcfBitmaps *p, FILE *stream, size_t *position);
+static void pcfBitmaps_load(TPcfBitmaps *p, TPcfReader *reader);
 static void pcfBdfEncodings_initialize(TPcfBdfEncodings *p);
 static void pcfBdfEncodings_finalize(TPcfBdfEncodings *p);
-static void pcfBdfEncodings_load(TPcfBdfEncodings *p, FILE *stream,
-				 size_t *position);
+static void pcfBdfEncodings_load(TPcfBdfEncodings *p, TPcfReader *reader);
 #ifdef PCF_DEBUG
 static void pcfBdfEncodings_debug(TPcfBdfEncodings *p);
 #endif
 static TPcfTable *searchSection(TPcf *p, uint32_t type);
-static size_t seekSection(FILE *stream, size_t current, size_t offset);
+static void seekSection(TPcfReader *reader, size_t offset);
+static void pcfLoad(TPcf *p, TPcfReader *reader);
+static void pcfCheck(TPcf *p, TPcfReader *reader);
+
+/*
+ * A broken font is not fatal, since it may be loaded while the terminal
+ * runs.  pcf_load() and pcf_loadImage() return false instead.
+ */
+static void pcfError(TPcfReader *reader, const char *format, ...)
+{
+	va_list ap;
+	char message[256];
+
+	assert(reader != NULL);
+
+	va_start(ap, format);
+	vsnprintf(message, sizeof(message), format, ap);
+	va_end(ap);
+	warnx("(FONT): %s", message);
+	longjmp(reader->error, 1);
+}
+
+/* refuse counts which the rest of an image cannot hold */
+static void checkCount(TPcfReader *reader, uint32_t n, size_t size)
+{
+	assert(reader != NULL);
+
+	if (reader->image != NULL &&
+	    n > (reader->size - reader->position) / size)
+		pcfError(reader, "Unexpected EOF.");
+}
 
-static void unexpectedEOF(void)
+static void readBytes(TPcfReader *reader, void *buf, size_t nbytes)
 {
-	errx(1, "(FONT): Unexpected EOF.");
+	assert(reader != NULL);
+	assert(buf != NULL);
+
+	if (reader->image != NULL) {
+		if (nbytes > reader->size - reader->position)
+			pcfError(reader, "Unexpected EOF.");
+		memcpy(buf, reader->image + reader->position, nbytes);
+	} else if (nbytes > 0 && fread(buf, nbytes, 1, reader->stream) != 1)
+		pcfError(reader, "Unexpected EOF.");
+	reader->position += nbytes;
 }
 
-static uint8_t readUINT8(FILE *stream, size_t *position)
+static uint8_t readUINT8(TPcfReader *reader)
 {
 	uint8_t value;
 
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	if (fread(&value, sizeof(uint8_t), 1, stream) != 1)
-		unexpectedEOF();
-	*position += sizeof(uint8_t);
+	readBytes(reader, &value, sizeof(uint8_t));
 	return value;
 }
 
-static uint16_t readUINT16LE(FILE *stream, size_t *position)
+static uint16_t readUINT16LE(TPcfReader *reader)
 {
 	uint16_t value;
 
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	if (fread(&value, sizeof(uint16_t), 1, stream) != 1)
-		unexpectedEOF();
-	*position += sizeof(uint16_t);
+	readBytes(reader, &value, sizeof(uint16_t));
 	return UINT16_SWAP_ON_BE(value);
 }
 
-static uint16_t readUINT16BE(FILE *stream, size_t *position)
+static uint16_t readUINT16BE(TPcfReader *reader)
 {
 	uint16_t value;
 
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	if (fread(&value, sizeof(uint16_t), 1, stream) != 1)
-		unexpectedEOF();
-	*position += sizeof(uint16_t);
+	readBytes(reader, &value, sizeof(uint16_t));
 	return UINT16_SWAP_ON_LE(value);
 }
 
-static uint16_t readUINT16(FILE *stream, TPcfFormat *format, size_t *position)
+static uint16_t readUINT16(TPcfReader *reader, TPcfFormat *format)
 {
-	assert(stream != NULL);
+	assert(reader != NULL);
 	assert(format != NULL);
-	assert(position != NULL);
 
-	return format->bit != 0 ? readUINT16BE(stream, position) :
-				  readUINT16LE(stream, position);
+	return format->bit != 0 ? readUINT16BE(reader) :
+				  readUINT16LE(reader);
 }
 
-static uint32_t readUINT32LE(FILE *stream, size_t *position)
+static uint32_t readUINT32LE(TPcfReader *reader)
 {
 	uint32_t value;
 
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	if (fread(&value, sizeof(uint32_t), 1, stream) != 1)
-		unexpectedEOF();
-	*position += sizeof(uint32_t);
+	readBytes(reader, &value, sizeof(uint32_t));
 	return UINT32_SWAP_ON_BE(value);
 }
 
-static uint32_t readUINT32BE(FILE *stream, size_t *position)
+static uint32_t readUINT32BE(TPcfReader *reader)
 {
 	uint32_t value;
 
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	if (fread(&value, sizeof(uint32_t), 1, stream) != 1)
-		unexpectedEOF();
-	*position += sizeof(uint32_t);
+	readBytes(reader, &value, sizeof(uint32_t));
 	return UINT32_SWAP_ON_LE(value);
 }
 
-static uint32_t readUINT32(FILE *stream, TPcfFormat *format, size_t *position)
+static uint32_t readUINT32(TPcfReader *reader, TPcfFormat *format)
 {
-	assert(stream != NULL);
+	assert(reader != NULL);
 	assert(format != NULL);
-	assert(position != NULL);
 
-	return format->bit != 0 ? readUINT32BE(stream, position) :
-				  readUINT32LE(stream, position);
+	return format->bit != 0 ? readUINT32BE(reader) :
+				  readUINT32LE(reader);
 }
 
-static void pcfFormat_load(TPcfFormat *p, FILE *stream, size_t *position)
+static void pcfFormat_load(TPcfFormat *p, TPcfReader *reader)
 {
 	uint32_t format;
 
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	format = readUINT32LE(stream, position);
+	format = readUINT32LE(reader);
 	p->id    = (format >> 8) & 0xfff;
 	p->scan  = 1 << ((format >> 4) & 0x3);
 	p->bit   = (format >> 3) & 1;
@@ -252,16 +281,15 @@ static void pcfFormat_load(TPcfFormat *p, FILE *stream, size_t *position)
 #endif
 }
 
-static void pcfTable_load(TPcfTable *p, FILE *stream, size_t *position)
+static void pcfTable_load(TPcfTable *p, TPcfReader *reader)
 {
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	p->type   = readUINT32LE(stream, position);
-	pcfFormat_load(&(p->format), stream, position);
-	p->size   = readUINT32LE(stream, position);
-	p->offset = readUINT32LE(stream, position);
+	p->type   = readUINT32LE(reader);
+	pcfFormat_load(&(p->format), reader);
+	p->size   = readUINT32LE(reader);
+	p->offset = readUINT32LE(reader);
 }
 
 #ifdef PCF_DEBUG
@@ -306,17 +334,15 @@ static void pcfTable_debug(TPcfTable *p)
 }
 #endif
 
-static void pcfProp_load(TPcfProp *p, FILE *stream, TPcfFormat *format,
-			 size_t *position)
+static void pcfProp_load(TPcfProp *p, TPcfReader *reader, TPcfFormat *format)
 {
 	assert(p != NULL);
-	assert(stream != NULL);
+	assert(reader != NULL);
 	assert(format != NULL);
-	assert(position != NULL);
 
-	p->name         = readUINT32(stream, format, position);
-	p->isStringProp = readUINT8(stream, position);
-	p->value        = readUINT32(stream, format, position);
+	p->name         = readUINT32(reader, format);
+	p->isStringProp = readUINT8(reader);
+	p->value        = readUINT32(reader, format);
 }
 
 static void pcfProperties_initialize(TPcfProperties *p)
@@ -345,34 +371,32 @@ static void pcfProperties_finalize(TPcfProperties *p)
 	}
 }
 
-static void pcfProperties_load(TPcfProperties *p, FILE *stream,
-			       size_t *position)
+static void pcfProperties_load(TPcfProperties *p, TPcfReader *reader)
 {
 	uint32_t i, dummy;
 
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	pcfFormat_load(&(p->format), stream, position);
+	pcfFormat_load(&(p->format), reader);
 	if (p->format.id != PCF_DEFAULT_FORMAT)
-		errx(1, "(FONT): Bad format id = %d.", p->format.id);
-	p->nProps = readUINT32(stream, &(p->format), position);
+		pcfError(reader, "Bad format id = %d.", p->format.id);
+	p->nProps = readUINT32(reader, &(p->format));
+	checkCount(reader, p->nProps, PCF_PROP_SIZE);
 	p->props = malloc(sizeof(TPcfProp) * p->nProps);
 	if (p->props == NULL)
 		err(1, "malloc()");
 	for (i = 0; i < p->nProps; i++)
-		pcfProp_load(&(p->props[i]), stream, &(p->format), position);
+		pcfProp_load(&(p->props[i]), reader, &(p->format));
 	dummy = 3 - (((PCF_PROP_SIZE * p->nProps) + 3) % 4);
 	for (i = 0; i < dummy; i++)
-		readUINT8(stream, position);
-	p->stringSize = readUINT32(stream, &(p->format), position);
+		readUINT8(reader);
+	p->stringSize = readUINT32(reader, &(p->format));
+	checkCount(reader, p->stringSize, sizeof(char));
 	p->string = malloc(sizeof(char) * p->stringSize);
 	if (p->string == NULL)
 		err(1, "malloc()");
-	if (fread(p->string, p->stringSize, 1, stream) != 1)
-		unexpectedEOF();
-	*position += sizeof(char) * p->stringSize;
+	readBytes(reader, p->string, sizeof(char) * p->stringSize);
 }
 
 #ifdef PCF_DEBUG
@@ -396,34 +420,30 @@ static void pcfProperties_debug(TPcfProperties *p)
 }
 #endif
 
-static void pcfMetric_load(TPcfMetric *p, FILE *stream, TPcfFormat *format,
-			   size_t *position)
+static void pcfMetric_load(TPcfMetric *p, TPcfReader *reader, TPcfFormat *format)
 {
 	assert(p != NULL);
-	assert(stream != NULL);
+	assert(reader != NULL);
 	assert(format != NULL);
-	assert(position != NULL);
 
-	p->leftSideBearing  = readUINT16(stream, format, position);
-	p->rightSideBearing = readUINT16(stream, format, position);
-	p->characterWidth   = readUINT16(stream, format, position);
-	p->ascent           = readUINT16(stream, format, position);
-	p->descent          = readUINT16(stream, format, position);
-	p->attributes       = readUINT16(stream, format, position);
+	p->leftSideBearing  = readUINT16(reader, format);
+	p->rightSideBearing = readUINT16(reader, format);
+	p->characterWidth   = readUINT16(reader, format);
+	p->ascent           = readUINT16(reader, format);
+	p->descent          = readUINT16(reader, format);
+	p->attributes       = readUINT16(reader, format);
 }
 
-static void pcfMetric_load_compressed(TPcfMetric *p, FILE *stream,
-				      size_t *position)
+static void pcfMetric_load_compressed(TPcfMetric *p, TPcfReader *reader)
 {
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	p->leftSideBearing  = readUINT8(stream, position) - 0x80;
-	p->rightSideBearing = readUINT8(stream, position) - 0x80;
-	p->characterWidth   = readUINT8(stream, position) - 0x80;
-	p->ascent           = readUINT8(stream, position) - 0x80;
-	p->descent          = readUINT8(stream, position) - 0x80;
+	p->leftSideBearing  = readUINT8(reader) - 0x80;
+	p->rightSideBearing = readUINT8(reader) - 0x80;
+	p->characterWidth   = readUINT8(reader) - 0x80;
+	p->ascent           = readUINT8(reader) - 0x80;
+	p->descent          = readUINT8(reader) - 0x80;
 	p->attributes       = 0;
 }
 
@@ -457,72 +477,70 @@ static void pcfMetrics_finalize(TPcfMetrics *p)
 	}
 }
 
-static void pcfMetrics_load(TPcfMetrics *p, FILE *stream, size_t *position)
+static void pcfMetrics_load(TPcfMetrics *p, TPcfReader *reader)
 {
 	uint32_t i;
 
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	pcfFormat_load(&(p->format), stream, position);
+	pcfFormat_load(&(p->format), reader);
 	if (p->format.id == PCF_DEFAULT_FORMAT) {
-		p->nMetrics = readUINT32(stream, &(p->format), position);
+		p->nMetrics = readUINT32(reader, &(p->format));
 #ifdef PCF_DEBUG
 		fprintf(stderr, "nMetrics: %d\n", p->nMetrics);
 #endif
+		checkCount(reader, p->nMetrics, PCF_METRIC_SIZE);
 		p->metrics = malloc(sizeof(TPcfMetric) * p->nMetrics);
 		if (p->metrics == NULL)
 			err(1, "malloc()");
 		for (i = 0; i < p->nMetrics; i++)
-			pcfMetric_load(&(p->metrics[i]), stream,
-				       &(p->format), position);
+			pcfMetric_load(&(p->metrics[i]), reader,
+				       &(p->format));
 	} else if (p->format.id == PCF_COMPRESSED_METRICS) {
-		p->nMetrics = readUINT16(stream, &(p->format), position);
+		p->nMetrics = readUINT16(reader, &(p->format));
 #ifdef PCF_DEBUG
 		fprintf(stderr, "nMetrics (compressed): %d\n", p->nMetrics);
 #endif
+		checkCount(reader, p->nMetrics, PCF_COMPRESSED_METRIC_SIZE);
 		p->metrics = malloc(sizeof(TPcfMetric) * p->nMetrics);
 		if (p->metrics == NULL)
 			err(1, "malloc()");
 		for (i = 0; i < p->nMetrics; i++)
-			pcfMetric_load_compressed(&(p->metrics[i]), stream,
-						  position);
+			pcfMetric_load_compressed(&(p->metrics[i]), reader);
 	} else
-		errx(1, "(FONT): Bad format id = %d.", p->format.id);
+		pcfError(reader, "Bad format id = %d.", p->format.id);
 }
 
-static void pcfAccelerators_load(TPcfAccelerators *p, FILE *stream,
-				 size_t *position)
+static void pcfAccelerators_load(TPcfAccelerators *p, TPcfReader *reader)
 {
 	uint8_t dummy;
 
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	pcfFormat_load(&(p->format), stream, position);
+	pcfFormat_load(&(p->format), reader);
 	if (p->format.id != PCF_DEFAULT_FORMAT &&
 	    p->format.id != PCF_ACCEL_W_INKBOUNDS)
-		errx(1, "(FONT): Bad format id = %d.", p->format.id);
-	p->noOverlap       = readUINT8(stream, position);
-	p->constantMetrics = readUINT8(stream, position);
-	p->terminalFont    = readUINT8(stream, position);
-	p->constantWidth   = readUINT8(stream, position);
-	p->inkInside       = readUINT8(stream, position);
-	p->inkMetrics      = readUINT8(stream, position);
-	p->drawDirection   = readUINT8(stream, position);
-	dummy              = readUINT8(stream, position);
-	p->fontAscent      = readUINT32(stream, &(p->format), position);
-	p->fontDescent     = readUINT32(stream, &(p->format), position);
-	p->maxOverlap      = readUINT32(stream, &(p->format), position);
-	pcfMetric_load(&(p->minBounds), stream, &(p->format), position);
-	pcfMetric_load(&(p->maxBounds), stream, &(p->format), position);
+		pcfError(reader, "Bad format id = %d.", p->format.id);
+	p->noOverlap       = readUINT8(reader);
+	p->constantMetrics = readUINT8(reader);
+	p->terminalFont    = readUINT8(reader);
+	p->constantWidth   = readUINT8(reader);
+	p->inkInside       = readUINT8(reader);
+	p->inkMetrics      = readUINT8(reader);
+	p->drawDirection   = readUINT8(reader);
+	dummy              = readUINT8(reader);
+	p->fontAscent      = readUINT32(reader, &(p->format));
+	p->fontDescent     = readUINT32(reader, &(p->format));
+	p->maxOverlap      = readUINT32(reader, &(p->format));
+	pcfMetric_load(&(p->minBounds), reader, &(p->format));
+	pcfMetric_load(&(p->maxBounds), reader, &(p->format));
 	if (p->format.id == PCF_ACCEL_W_INKBOUNDS) {
-		pcfMetric_load(&(p->ink_minBounds), stream,
-			       &(p->format), position);
-		pcfMetric_load(&(p->ink_maxBounds), stream,
-			       &(p->format), position);
+		pcfMetric_load(&(p->ink_minBounds), reader,
+			       &(p->format));
+		pcfMetric_load(&(p->ink_maxBounds), reader,
+			       &(p->format));
 	}
 }
 
@@ -544,6 +562,7 @@ static void pcfBitmaps_initialize(TPcfBitmaps *p)
 	p->nBitmaps = 0;
 	p->bitmapOffsets = NULL;
 	p->bitmaps = NULL;
+	p->inImage = false;
 }
 
 static void pcfBitmaps_finalize(TPcfBitmaps *p)
@@ -556,9 +575,11 @@ static void pcfBitmaps_finalize(TPcfBitmaps *p)
 		p->bitmapOffsets = NULL;
 	}
 	if (p->bitmaps != NULL) {
-		free(p->bitmaps);
+		if (!p->inImage)
+			free(p->bitmaps);
 		p->bitmaps = NULL;
 	}
+	p->inImage = false;
 }
 
 static void pcfBitmaps_swap(TPcfBitmaps *p, TPcfFormat *format)
@@ -587,41 +608,46 @@ static void pcfBitmaps_swap(TPcfBitmaps *p, TPcfFormat *format)
 	}
 }
 
-static void pcfBitmaps_load(TPcfBitmaps *p, FILE *stream, size_t *position)
+static void pcfBitmaps_load(TPcfBitmaps *p, TPcfReader *reader)
 {
 	uint32_t i, bitmapSize;
 
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	pcfFormat_load(&(p->format), stream, position);
+	pcfFormat_load(&(p->format), reader);
 	if (p->format.id != PCF_DEFAULT_FORMAT)
-		errx(1, "(FONT): Bad format id = %d.", p->format.id);
-	p->nBitmaps = readUINT32(stream, &(p->format), position);
+		pcfError(reader, "Bad format id = %d.", p->format.id);
+	p->nBitmaps = readUINT32(reader, &(p->format));
 #if PCF_DEBUG
 	fprintf(stderr, "nBitmaps : %d\n", p->nBitmaps);
 #endif
+	checkCount(reader, p->nBitmaps, sizeof(uint32_t));
 	p->bitmapOffsets = malloc(sizeof(uint32_t) * p->nBitmaps);
 	if (p->bitmapOffsets == NULL)
 		err(1, "malloc()");
 	for (i = 0; i < p->nBitmaps; i++)
-		p->bitmapOffsets[i] = readUINT32(stream, &(p->format),
-						 position);
+		p->bitmapOffsets[i] = readUINT32(reader, &(p->format));
 	for (i = 0; i < GLYPHPADOPTIONS; i++)
-		p->bitmapSizes[i]   = readUINT32(stream, &(p->format),
-						 position);
+		p->bitmapSizes[i]   = readUINT32(reader, &(p->format));
 	bitmapSize = p->bitmapSizes[p->format.glyph];
 #if PCF_DEBUG
 	fprintf(stderr, "bitmapSize : %d bytes - %d (%d bytes/line)\n",
 		bitmapSize, p->format.glyph, 1 << p->format.glyph);
 #endif
-	p->bitmaps = malloc(sizeof(u_char) * bitmapSize);
-	if (p->bitmaps == NULL)
-		err(1, "malloc()");
-	if (fread(p->bitmaps, bitmapSize, 1, stream) != 1)
-		unexpectedEOF();
-	*position += sizeof(u_char) * bitmapSize;
+	if (reader->image != NULL) {
+		/* refer to the image in place instead of copying it */
+		if (bitmapSize > reader->size - reader->position)
+			pcfError(reader, "Unexpected EOF.");
+		p->bitmaps = reader->image + reader->position;
+		p->inImage = true;
+		reader->position += bitmapSize;
+	} else {
+		p->bitmaps = malloc(sizeof(u_char) * bitmapSize);
+		if (p->bitmaps == NULL)
+			err(1, "malloc()");
+		readBytes(reader, p->bitmaps, sizeof(u_char) * bitmapSize);
+	}
 	pcfBitmaps_swap(p, &(p->format));
 }
 
@@ -642,31 +668,30 @@ static void pcfBdfEncodings_finalize(TPcfBdfEncodings *p)
 	}
 }
 
-static void pcfBdfEncodings_load(TPcfBdfEncodings *p, FILE *stream,
-				 size_t *position)
+static void pcfBdfEncodings_load(TPcfBdfEncodings *p, TPcfReader *reader)
 {
 	uint32_t i, n;
 
 	assert(p != NULL);
-	assert(stream != NULL);
-	assert(position != NULL);
+	assert(reader != NULL);
 
-	pcfFormat_load(&(p->format), stream, position);
+	pcfFormat_load(&(p->format), reader);
 	if (p->format.id != PCF_DEFAULT_FORMAT)
-		errx(1, "(FONT): Bad format id = %d.", p->format.id);
-	p->firstCol  = readUINT16(stream, &(p->format), position);
-	p->lastCol   = readUINT16(stream, &(p->format), position);
-	p->firstRow  = readUINT16(stream, &(p->format), position);
-	p->lastRow   = readUINT16(stream, &(p->format), position);
-	p->defaultCh = readUINT16(stream, &(p->format), position);
-	assert(p->lastCol >= p->firstCol);
-	assert(p->lastRow >= p->firstRow);
+		pcfError(reader, "Bad format id = %d.", p->format.id);
+	p->firstCol  = readUINT16(reader, &(p->format));
+	p->lastCol   = readUINT16(reader, &(p->format));
+	p->firstRow  = readUINT16(reader, &(p->format));
+	p->lastRow   = readUINT16(reader, &(p->format));
+	p->defaultCh = readUINT16(reader, &(p->format));
+	if (p->lastCol < p->firstCol || p->lastRow < p->firstRow)
+		pcfError(reader, "Bad encoding range.");
 	n = (p->lastCol - p->firstCol + 1) * (p->lastRow - p->firstRow + 1);
+	checkCount(reader, n, sizeof(uint16_t));
 	p->encodings = malloc(sizeof(uint16_t) * n);
 	if (p->encodings == NULL)
 		err(1, "malloc()");
 	for (i = 0; i < n; i++)
-		p->encodings[i] = readUINT16(stream, &(p->format), position);
+		p->encodings[i] = readUINT16(reader, &(p->format));
 }
 
 #ifdef PCF_DEBUG
@@ -702,26 +727,28 @@ static TPcfTable *searchSection(TPcf *p, uint32_t type)
 	return result;
 }
 
-static size_t seekSection(FILE *stream, size_t current, size_t offset)
+static void seekSection(TPcfReader *reader, size_t offset)
 {
 	size_t nbytes;
 	size_t n;
 	char dummy[1024];
 
-	assert(stream != NULL);
+	assert(reader != NULL);
 
-	if (current > offset)
-		errx(1, "(FONT): Backward seeking.");
-	if (current == offset)
-		return offset;
-	nbytes = offset - current;
+	if (reader->image != NULL) {
+		if (offset > reader->size)
+			pcfError(reader, "Unexpected EOF.");
+		reader->position = offset;
+		return;
+	}
+	if (reader->position > offset)
+		pcfError(reader, "Backward seeking.");
+	nbytes = offset - reader->position;
 	while (nbytes != 0) {
 		n = nbytes > sizeof(dummy) ? sizeof(dummy) : nbytes;
-		if (fread(dummy, n, 1, stream) != 1)
-			unexpectedEOF();
+		readBytes(reader, dummy, n);
 		nbytes -= n;
 	}
-	return offset;
 }
 
 void pcf_initialize(TPcf *p)
@@ -751,27 +778,26 @@ void pcf_finalize(TPcf *p)
 	pcfBdfEncodings_finalize(&(p->bdfEncodings));
 }
 
-void pcf_load(TPcf *p, FILE *stream)
+static void pcfLoad(TPcf *p, TPcfReader *reader)
 {
 	uint32_t version;
-	size_t position;
 	TPcfTable *table;
 	uint32_t i;
 
 	assert(p != NULL);
-	assert(stream != NULL);
+	assert(reader != NULL);
 
-	position = 0;
 	/* Table of Contents */
-	version = readUINT32LE(stream, &position);
+	version = readUINT32LE(reader);
 	if (version != PCF_VERSION)
-		errx(1, "(FONT): PCF file format error: Bad signature.");
-	p->nTables = readUINT32LE(stream, &position);
+		pcfError(reader, "PCF file format error: Bad signature.");
+	p->nTables = readUINT32LE(reader);
+	checkCount(reader, p->nTables, PCF_TABLE_SIZE);
 	p->tables = malloc(sizeof(TPcfTable) * p->nTables);
 	if (p->tables == NULL)
 		err(1, "malloc()");
 	for (i = 0; i < p->nTables; i++) {
-		pcfTable_load(&(p->tables[i]), stream, &position);
+		pcfTable_load(&(p->tables[i]), reader);
 #if PCF_DEBUG
 		fprintf(stderr, "Table %d :", i);
 		pcfTable_debug(&(p->tables[i]));
@@ -779,110 +805,173 @@ void pcf_load(TPcf *p, FILE *stream)
 #endif
 	}
 #if PCF_DEBUG
-	fprintf(stderr, "total gain = %d\n", position);
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
 
 	/* Properties */
 	table = searchSection(p, PCF_PROPERTIES);
 	if (table == NULL)
-		errx(1, "(FONT): Properties section not exist.");
-	position = seekSection(stream, position, table->offset);
+		pcfError(reader, "Properties section not exist.");
+	seekSection(reader, table->offset);
 #if PCF_DEBUG
-	fprintf(stderr, "total gain = %d\n", position);
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 	fprintf(stderr, "load Properties\n");
 #endif
-	pcfProperties_load(&(p->properties), stream, &position);
+	pcfProperties_load(&(p->properties), reader);
 #if PCF_DEBUG
 	pcfProperties_debug(&(p->properties));
-	fprintf(stderr, "total gain = %d\n", position);
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
 
 	/* Accelerators */
 	table = searchSection(p, PCF_ACCELERATORS);
 	if (searchSection(p, PCF_BDF_ACCELERATORS) == NULL) {
 		if (table == NULL)
-			errx(1, "(FONT): Accelerators section and BDF Accelerators section not found.");
+			pcfError(reader, "Accelerators section and BDF Accelerators section not found.");
 #if PCF_DEBUG
-		fprintf(stderr, "total gain = %d:%ld\n",
-				position, ftell(stream));
+		fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
-		position = seekSection(stream, position, table->offset);
+		seekSection(reader, table->offset);
 #if PCF_DEBUG
-		fprintf(stderr, "total gain = %d:%ld\n",
-				position, ftell(stream));
+		fprintf(stderr, "total gain = %zu\n", reader->position);
 		fprintf(stderr, "load Accelerators\n");
 #endif
-		pcfAccelerators_load(&(p->accelerators), stream, &position);
+		pcfAccelerators_load(&(p->accelerators), reader);
 #if PCF_DEBUG
 		pcfAccelerators_debug(&(p->accelerators));
-		fprintf(stderr, "total gain = %d\n", position);
+		fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
 	}
 
 	/*  Metrics */
 	table = searchSection(p, PCF_METRICS);
 	if (table == NULL)
-		errx(1, "(FONT): Metrics section not found.");
-	position = seekSection(stream, position, table->offset);
+		pcfError(reader, "Metrics section not found.");
+	seekSection(reader, table->offset);
 #if PCF_DEBUG
-	fprintf(stderr, "total gain = %d\n", position);
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 	fprintf(stderr, "load Metrics\n");
 #endif
-	pcfMetrics_load(&(p->metrics), stream, &position);
+	pcfMetrics_load(&(p->metrics), reader);
 #if PCF_DEBUG
-	fprintf(stderr, "total gain = %d\n", position);
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
 
 	/* Bitmaps */
 	table = searchSection(p, PCF_BITMAPS);
 	if (table == NULL)
-		errx(1, "(FONT): Bitmaps section not found.");
-	position = seekSection(stream, position, table->offset);
+		pcfError(reader, "Bitmaps section not found.");
+	seekSection(reader, table->offset);
 #if PCF_DEBUG
-	fprintf(stderr, "total gain = %d\n", position);
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 	fprintf(stderr, "load Bitmaps\n");
 #endif
-	pcfBitmaps_load(&(p->bitmaps), stream, &position);
+	pcfBitmaps_load(&(p->bitmaps), reader);
 #if PCF_DEBUG
-	fprintf(stderr, "total gain = %d\n", position);
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
 
 	/* BDF Encodings */
 	table = searchSection(p, PCF_BDF_ENCODINGS);
 	if (table == NULL)
-		errx(1, "(FONT): BDF Encodings section not found.");
-	position = seekSection(stream, position, table->offset);
+		pcfError(reader, "BDF Encodings section not found.");
+	seekSection(reader, table->offset);
 #if PCF_DEBUG
-	fprintf(stderr, "total gain = %d:%ld\n", position, ftell(stream));
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 	fprintf(stderr, "load BDF Encodings\n");
 #endif
-	pcfBdfEncodings_load(&(p->bdfEncodings), stream, &position);
+	pcfBdfEncodings_load(&(p->bdfEncodings), reader);
 #if PCF_DEBUG
 	pcfBdfEncodings_debug(&(p->bdfEncodings));
-	fprintf(stderr, "total gain = %d:%ld\n", position, ftell(stream));
+	fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
 
 	/* BDF Accelerators */
 	table = searchSection(p, PCF_BDF_ACCELERATORS);
 	if (table != NULL) {
-		position = seekSection(stream, position, table->offset);
+		seekSection(reader, table->offset);
 #if PCF_DEBUG
-		fprintf(stderr, "total gain = %d\n", position);
+		fprintf(stderr, "total gain = %zu\n", reader->position);
 		fprintf(stderr, "load BDF Accelerators\n");
 #endif
-		pcfAccelerators_load(&(p->accelerators), stream, &position);
+		pcfAccelerators_load(&(p->accelerators), reader);
 #if PCF_DEBUG
 		pcfAccelerators_debug(&(p->accelerators));
-		fprintf(stderr, "total gain = %d\n", position);
+		fprintf(stderr, "total gain = %zu\n", reader->position);
 #endif
 	}
+	pcfCheck(p, reader);
+}
+
+/* every glyph must refer to a bitmap and a metric which exist */
+static void pcfCheck(TPcf *p, TPcfReader *reader)
+{
+	uint32_t i, n, bitmapSize;
+	uint16_t encoding;
+
+	assert(p != NULL);
+	assert(reader != NULL);
+
+	bitmapSize = p->bitmaps.bitmapSizes[p->bitmaps.format.glyph];
+	n = (p->bdfEncodings.lastCol - p->bdfEncodings.firstCol + 1) *
+	    (p->bdfEncodings.lastRow - p->bdfEncodings.firstRow + 1);
+	for (i = 0; i < n; i++) {
+		encoding = p->bdfEncodings.encodings[i];
+		if (encoding == (uint16_t)NO_SUCH_CHAR)
+			continue;
+		if (encoding >= p->bitmaps.nBitmaps ||
+		    encoding >= p->metrics.nMetrics ||
+		    p->bitmaps.bitmapOffsets[encoding] >= bitmapSize)
+			pcfError(reader, "Bad encoding = %u.", encoding);
+	}
+}
+
+/* false if the font is broken; pcf_finalize() frees what was read */
+bool pcf_load(TPcf *p, FILE *stream)
+{
+	TPcfReader reader;
+
+	assert(p != NULL);
+	assert(stream != NULL);
+
+	reader.stream = stream;
+	reader.image = NULL;
+	reader.size = 0;
+	reader.position = 0;
+	if (setjmp(reader.error) != 0)
+		return false;
+	pcfLoad(p, &reader);
+	return true;
+}
+
+/*
+ * Load from a font image already in memory.  The bitmaps are referred to
+ * in place, so the image must be writable (LSB fonts are bit-swapped) and
+ * must outlive the font built by pcf_as_font().
+ */
+bool pcf_loadImage(TPcf *p, u_char *image, size_t size)
+{
+	TPcfReader reader;
+
+	assert(p != NULL);
+	assert(image != NULL);
+
+	reader.stream = NULL;
+	reader.image = image;
+	reader.size = size;
+	reader.position = 0;
+	if (setjmp(reader.error) != 0)
+		return false;
+	pcfLoad(p, &reader);
+	return true;
 }
 
 void pcf_as_font(TPcf *p, TFont *font)
 {
 	TPcfMetric *metric;
-	uint32_t bitmapOffset, bitmapSize;
+	uint32_t bitmapSize;
 	uint16_t encoding, defaultCh, cols;
+	u_short width;
 	uint8_t col, row;
 	uint32_t i, glyphs;
 
@@ -895,10 +984,15 @@ void pcf_as_font(TPcf *p, TFont *font)
 		       p->accelerators.minBounds.descent;
 
 	bitmapSize = p->bitmaps.bitmapSizes[p->bitmaps.format.glyph];
-	font->bitmap = malloc(bitmapSize);
-	if (font->bitmap == NULL)
-		err(1, "malloc()");
-	memcpy(font->bitmap, p->bitmaps.bitmaps, bitmapSize);
+	font->bitmapSize = bitmapSize;
+	if (p->bitmaps.inImage)
+		font->bitmap = p->bitmaps.bitmaps;
+	else {
+		font->bitmap = malloc(bitmapSize);
+		if (font->bitmap == NULL)
+			err(1, "malloc()");
+		memcpy(font->bitmap, p->bitmaps.bitmaps, bitmapSize);
+	}
 
 	font->bytesPerWidth = 1 << p->bitmaps.format.glyph;
 	font->bytesPerChar = font->bytesPerWidth * font->height;
@@ -909,22 +1003,8 @@ void pcf_as_font(TPcf *p, TFont *font)
 	font->colspan = font->coll - font->colf + 1;
 
 	glyphs = (font->coll - font->colf + 1) * (font->rowl - font->rowf + 1);
-	font->glyphs = malloc(sizeof(u_char *) * glyphs);
-	if (font->glyphs == NULL)
-		err(1, "malloc()");
-
-	font->glyphWidths = NULL;
-	if (p->accelerators.terminalFont == 0) {
-		/* not terminal font */
-		font->glyphWidths = malloc(sizeof(u_short) * glyphs);
-		if (font->glyphWidths == NULL)
-			err(1, "malloc()");
-	}
-
-	font->defaultGlyph = malloc(font->bytesPerChar);
-	if (font->defaultGlyph == NULL)
-		err(1, "malloc()");
-	memset(font->defaultGlyph, 0xff, font->bytesPerChar);
+	/* only fonts which are not terminal fonts have glyph widths */
+	font_allocateGlyphs(font, p->accelerators.terminalFont == 0);
 
 	defaultCh = p->bdfEncodings.defaultCh;
 	if (defaultCh != (uint16_t)NO_SUCH_CHAR) {
@@ -946,23 +1026,22 @@ void pcf_as_font(TPcf *p, TFont *font)
 	for (i = 0; i < glyphs; i++) {
 		encoding = p->bdfEncodings.encodings[i];
 		if (encoding == (uint16_t)NO_SUCH_CHAR) {
-			if (defaultCh == (uint16_t)NO_SUCH_CHAR) {
-				font->glyphs[i] = font->defaultGlyph;
-				if (font->glyphWidths != NULL)
-					font->glyphWidths[i] = font->width;
-				continue;
-			}
+			if (defaultCh == (uint16_t)NO_SUCH_CHAR)
+				continue; /* default glyph */
 			encoding = p->bdfEncodings.encodings[defaultCh];
+			if (encoding == (uint16_t)NO_SUCH_CHAR)
+				continue;
 		}
 		assert(p->bitmaps.nBitmaps > encoding);
-		bitmapOffset = p->bitmaps.bitmapOffsets[encoding];
-		font->glyphs[i] = font->bitmap + bitmapOffset;
+		width = font->width;
 		if (font->glyphWidths != NULL) {
 			assert(p->metrics.nMetrics > encoding);
 			metric = &p->metrics.metrics[encoding];
-			font->glyphWidths[i] = metric->rightSideBearing -
-					       metric->leftSideBearing;
+			width = metric->rightSideBearing -
+				metric->leftSideBearing;
 		}
+		font_setGlyph(font, i, p->bitmaps.bitmapOffsets[encoding],
+			      width);
 	}
 }
 
@@ -34,6 +34,7 @@
 #define INCLUDE_PCF_H
 
 #include <sys/types.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -110,6 +111,7 @@ typedef struct Raw_TPcfBitmaps {
 	uint32_t *bitmapOffsets;
 	uint32_t bitmapSizes[GLYPHPADOPTIONS];
 	u_char *bitmaps;
+	bool inImage;
 } TPcfBitmaps;
 
 typedef struct Raw_TPcfBdfEncodings {
@@ -134,7 +136,8 @@ typedef struct Raw_TPcf {
 
 void pcf_initialize(TPcf *p);
 void pcf_finalize(TPcf *p);
-void pcf_load(TPcf *p, FILE *stream);
+bool pcf_load(TPcf *p, FILE *stream);
+bool pcf_loadImage(TPcf *p, u_char *image, size_t size);
 void pcf_as_font(TPcf *p, TFont *font);
 
 #endif /* INCLUDE_PCF_H */
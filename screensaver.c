@@ -32,6 +32,7 @@
 #include <sys/time.h>
 #include <assert.h>
 #include <err.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -221,6 +222,25 @@ bool screensaver_isTimeout(void)
 	return elapsedTime >= screensaver.timeout;
 }
 
+/* msec. until screensaver_isTimeout() becomes true */
+int screensaver_getTimeout(void)
+{
+	struct timeval now, diff;
+	long remainingTime;
+
+	assert(initialized);
+
+	timerclear(&diff);
+	gettimeofday(&now, NULL);
+	timersub(&now, &screensaver.timer, &diff);
+	remainingTime = (long)screensaver.timeout * 60 - diff.tv_sec; /* sec. */
+	if (remainingTime <= 0)
+		return 0;
+	if (remainingTime > INT_MAX / 1000)
+		return INT_MAX; /* waking up early is harmless */
+	return remainingTime * 1000 - diff.tv_usec / 1000;
+}
+
 void screensaver_execute(const bool status)
 {
 	int mode;
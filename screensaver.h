@@ -38,6 +38,7 @@ bool screensaver_isEnable(void);
 bool screensaver_isRunning(void);
 void screensaver_resetTimer(void);
 bool screensaver_isTimeout(void);
+int screensaver_getTimeout(void);
 void screensaver_execute(const bool status);
 
 #endif /* INCLUDE_SCREENSAVER_H */
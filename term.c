@@ -46,10 +46,10 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <assert.h>
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -64,6 +64,14 @@
 #else
 #include <utmpx.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_SIGNALFD_H
+#include <sys/signalfd.h>
+#endif
 
 #if defined (__linux__)
 #include <sys/vt.h>
@@ -104,9 +112,81 @@
 static TTerm term;
 static TTerm *const self = &term;
 static pid_t child;
-static fd_set orgReadFds;
-static int numFds;
 static bool initialized;
+
+/*
+ * Descriptors consoleHandler() waits on: stdin, the master pty, the
+ * mouse and the signal descriptor.  epoll where available, poll(2)
+ * otherwise.
+ */
+#define MAX_EVENT_FDS (4)
+
+static struct {
+#ifdef HAVE_SYS_EPOLL_H
+	int epollFd;
+	struct epoll_event ready[MAX_EVENT_FDS];
+	int nReady;
+#else
+	struct pollfd fds[MAX_EVENT_FDS];
+	int nFds;
+#endif
+} events;
+
+/*
+ * VT acquire/release and SIGCHLD are blocked and read from signalFd by
+ * consoleHandler(), so they arrive as ordered events and never in the
+ * middle of a draw.  signalfd(2) where available; elsewhere the handlers
+ * write the signal number to a pipe.
+ */
+static int signalFd = -1;
+#ifndef HAVE_SYS_SIGNALFD_H
+static int signalPipe = -1;
+#endif
+
+/*
+ * Master pty reads.  The buffer starts small and doubles whenever a read
+ * fills it, so bulk output is taken in few large packets.
+ */
+#define PTY_BUF_MIN (4096)
+#define PTY_BUF_MAX (256 * 1024)
+
+static struct {
+	u_char *buf;
+	size_t size;
+} pty;
+
+/*
+ * While Scroll Lock is on the master pty is left out of the event set, so
+ * the kernel's pty buffer holds the producer back.  The console reports no
+ * key event for Scroll Lock itself, so the LED is polled as output arrives,
+ * and while suspended on every wakeup and at most OUTPUT_RESUME_INTERVAL
+ * msec. apart.
+ */
+#define OUTPUT_RESUME_INTERVAL (100)
+
+static bool outputSuspended;
+
+/*
+ * Pasted text waiting for the master pty.  term_paste() queues it and
+ * consoleHandler() writes up to PASTE_CHUNK bytes each time the pty is
+ * writable, so a large paste neither blocks the loop nor stops output.
+ * term_write() queues here too what the pty will not take at once, so
+ * keys and replies are neither dropped nor reordered.
+ */
+#define PASTE_CHUNK (4096)
+
+static struct {
+	u_char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+} paste;
+
+typedef struct {
+	const char *from;
+	const char *to;
+} TKeyMap;
+
 static struct termios* termios = NULL;
 
 static void finalize(void);
@@ -114,29 +194,38 @@ static void finalizer(void);
 static void acquireVirtualTerminal(int signum);
 static void releaseVirtualTerminal(int signum);
 static void childHandler(int signum);
+static void openSignals(void);
+static void closeSignals(void);
+#ifndef HAVE_SYS_SIGNALFD_H
+static void signalHandler(int signum);
+#endif
+static void handleSignals(void);
 static bool openPseudoTerminal(void);
 static void enableMouse(void);
 static void disableMouse(void);
+static void initializeEvents(void);
+static void watchEvent(int fd, bool readable, bool writable);
+static int waitEvents(int timeout);
+static bool isEventReady(int fd);
+static bool isEventWritable(int fd);
 static void executeShell(const char *shell, char *const args[],
 			 const char *name);
 static void consoleHandler(void);
+static void readPseudoTerminal(void);
+static void suspendOutput(bool suspend);
+static void watchPseudoTerminal(void);
+static void writePaste(void);
+static int getEventTimeout(void);
 static void writeLoginRecord(void);
 static void eraseLoginRecord(void);
-size_t strrep(u_char *p, size_t len, size_t maxlen, size_t oldlen,
-	      const char *newstr);
-static size_t applicationCursor(u_char *buf, size_t len, size_t maxlen);
-#if defined (__FreeBSD__)
-static size_t sysconsTolinux(u_char *buf, size_t len, size_t maxlen);
-#endif
-#if defined (__NetBSD__) || defined (__OpenBSD__)
-static size_t wsconsTolinux(u_char *buf, size_t len, size_t maxlen);
-#endif
+static void initializeKeyMaps(void);
+static const TKeyMap *findKeyMap(const u_char *in, size_t len);
+static size_t translateInput(const u_char *in, size_t len,
+			     u_char *out, size_t maxlen);
 
 void term_initialize(TCaps *caps, u_int history, const char *encoding,
 		     int ambiguous)
 {
-	struct sigaction act;
-
 	assert(!initialized);
 	assert(caps != NULL);
 	assert(encoding != NULL);
@@ -146,6 +235,13 @@ void term_initialize(TCaps *caps, u_int history, const char *encoding,
 	self->masterPty = -1;
 	self->slavePty  = -1;
 	self->device[0] = '\0';
+#ifdef HAVE_SYS_EPOLL_H
+	events.epollFd = -1;
+#endif
+	pty.size = PTY_BUF_MIN;
+	pty.buf = malloc(pty.size);
+	if (pty.buf == NULL)
+		err(1, "malloc()");
 	termios = malloc(sizeof(struct termios));
 	if (termios == NULL)
 		err(1, "malloc()");
@@ -156,22 +252,18 @@ void term_initialize(TCaps *caps, u_int history, const char *encoding,
 	}
 	if (!openPseudoTerminal())
 		errx(1, "Could not open pseudo-terminal.");
+	initializeKeyMaps();
 	vterm_initialize(&(self->vterm), self, caps, history,
-			 gFramebuffer.width / gFontsWidth,
-			 gFramebuffer.height / gFontsHeight,
+			 gFramebuffer.screenWidth / gFontsWidth,
+			 gFramebuffer.screenHeight / gFontsHeight,
 			 encoding, ambiguous);
-	bzero(&act, sizeof(act));
-	act.sa_handler = childHandler;
-	act.sa_flags = SA_NOCLDSTOP | SA_RESTART;
-	sigaction(SIGCHLD, &act, NULL);
+	openSignals();
 	console_setAcquireHandler(acquireVirtualTerminal);
 	console_setReleaseHandler(releaseVirtualTerminal);
 }
 
 static void finalize(void)
 {
-	struct sigaction act;
-
 	assert(initialized);
 
 	eraseLoginRecord();
@@ -184,9 +276,18 @@ static void finalize(void)
 		close(self->masterPty);
 		self->masterPty = -1;
 	}
-	bzero(&act, sizeof(act));
-	act.sa_handler = SIG_DFL;
-	sigaction(SIGCHLD, &act, NULL);
+#ifdef HAVE_SYS_EPOLL_H
+	if (events.epollFd != -1) {
+		close(events.epollFd);
+		events.epollFd = -1;
+	}
+#endif
+	closeSignals();
+	free(pty.buf);
+	pty.buf = NULL;
+	free(paste.buf);
+	paste.buf = NULL;
+	paste.size = paste.head = paste.tail = 0;
 	initialized = false;
 }
 
@@ -199,8 +300,10 @@ static void acquireVirtualTerminal(int signum)
 {
 	UNUSED_VARIABLE(signum);
 	if (!((&self->vterm))->active) {
+		framebuffer_lock();
 		framebuffer_reset();
 		((&self->vterm))->active = true;
+		framebuffer_unlock();
 		vterm_unclean(&(self->vterm));
 		((&self->vterm))->textClear = true;
 		vterm_refresh(&(self->vterm));
@@ -219,7 +322,10 @@ static void acquireVirtualTerminal(int signum)
 static void releaseVirtualTerminal(int signum)
 {
 	UNUSED_VARIABLE(signum);
+	/* wait for the renderer to finish drawing */
+	framebuffer_lock();
 	((&self->vterm))->active = false;
+	framebuffer_unlock();
 	if (mouse_isEnable()) {
 		disableMouse();
 		mouse_stop();
@@ -235,11 +341,10 @@ static void releaseVirtualTerminal(int signum)
 
 static void childHandler(int signum)
 {
-	int status, errsv;
+	int status;
 	pid_t pid;
 
 	UNUSED_VARIABLE(signum);
-	errsv = errno;
 	pid = waitpid(child, &status, WNOHANG);
 	if (pid == (pid_t)-1 && errno != ECHILD)
 		err(1, "waitpid()");
@@ -253,8 +358,122 @@ static void childHandler(int signum)
 		fputs("Finished.\n", stderr);
 		exit(EXIT_SUCCESS);
 	}
+}
+
+static void openSignals(void)
+{
+	sigset_t set;
+#ifndef HAVE_SYS_SIGNALFD_H
+	struct sigaction act;
+	int fds[2], i;
+#endif
+
+	assert(initialized);
+
+	sigemptyset(&set);
+	sigaddset(&set, CONSOLE_RELEASE_SIGNAL);
+	sigaddset(&set, CONSOLE_ACQUIRE_SIGNAL);
+	sigaddset(&set, SIGCHLD);
+#ifdef HAVE_SYS_SIGNALFD_H
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	signalFd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalFd == -1)
+		err(1, "signalfd()");
+#else
+	if (pipe(fds) == -1)
+		err(1, "pipe()");
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	signalFd = fds[0];
+	signalPipe = fds[1];
+	bzero(&act, sizeof(act));
+	act.sa_handler = signalHandler;
+	act.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+	sigaction(CONSOLE_RELEASE_SIGNAL, &act, NULL);
+	sigaction(CONSOLE_ACQUIRE_SIGNAL, &act, NULL);
+	sigaction(SIGCHLD, &act, NULL);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+#endif
+}
+
+static void closeSignals(void)
+{
+	struct sigaction act;
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, CONSOLE_RELEASE_SIGNAL);
+	sigaddset(&set, CONSOLE_ACQUIRE_SIGNAL);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	bzero(&act, sizeof(act));
+	act.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &act, NULL);
+	if (signalFd != -1) {
+		close(signalFd);
+		signalFd = -1;
+	}
+#ifndef HAVE_SYS_SIGNALFD_H
+	if (signalPipe != -1) {
+		close(signalPipe);
+		signalPipe = -1;
+	}
+#endif
+	/* VT signals stay blocked for console's finalize() */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+#ifndef HAVE_SYS_SIGNALFD_H
+static void signalHandler(int signum)
+{
+	int errsv;
+	u_char c;
+
+	errsv = errno;
+	c = (u_char)signum;
+	write(signalPipe, &c, 1);
 	errno = errsv;
 }
+#endif
+
+#define MAX_SIGNALS (8)
+
+static void handleSignals(void)
+{
+#ifdef HAVE_SYS_SIGNALFD_H
+	struct signalfd_siginfo info[MAX_SIGNALS];
+#else
+	u_char info[MAX_SIGNALS];
+#endif
+	ssize_t nbytes;
+	int i, n, signum;
+
+	assert(initialized);
+
+	for (;;) {
+		nbytes = read(signalFd, info, sizeof(info));
+		if (nbytes == -1 && errno == EINTR)
+			continue;
+		if (nbytes <= 0)
+			break;
+		n = nbytes / sizeof(info[0]);
+		for (i = 0; i < n; i++) {
+#ifdef HAVE_SYS_SIGNALFD_H
+			signum = info[i].ssi_signo;
+#else
+			signum = info[i];
+#endif
+			if (signum == SIGCHLD)
+				childHandler(signum);
+			else
+				console_handleSignal(signum);
+		}
+	}
+}
 
 static bool openPseudoTerminal(void)
 {
@@ -285,11 +504,7 @@ static void enableMouse(void)
 
 	mouseFd = mouse_getFd();
 	if (mouseFd != -1)
-		FD_SET(mouseFd, &orgReadFds);
-	if (mouseFd > self->masterPty)
-		numFds = mouseFd + 1;
-	else
-		numFds = self->masterPty + 1;
+		watchEvent(mouseFd, true, false);
 }
 
 static void disableMouse(void)
@@ -300,8 +515,120 @@ static void disableMouse(void)
 
 	mouseFd = mouse_getFd();
 	if (mouseFd != -1)
-		FD_CLR(mouseFd, &orgReadFds);
-	numFds = self->masterPty + 1;
+		watchEvent(mouseFd, false, false);
+}
+
+static void initializeEvents(void)
+{
+	assert(initialized);
+
+#ifdef HAVE_SYS_EPOLL_H
+	events.epollFd = epoll_create(MAX_EVENT_FDS);
+	if (events.epollFd == -1)
+		err(1, "epoll_create()");
+	events.nReady = 0;
+#else
+	events.nFds = 0;
+#endif
+}
+
+static void watchEvent(int fd, bool readable, bool writable)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event event;
+#else
+	int i;
+#endif
+
+	assert(initialized);
+	assert(fd != -1);
+
+#ifdef HAVE_SYS_EPOLL_H
+	bzero(&event, sizeof(event));
+	event.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+	event.data.fd = fd;
+	if (readable || writable) {
+		if (epoll_ctl(events.epollFd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+		    (errno != ENOENT ||
+		     epoll_ctl(events.epollFd, EPOLL_CTL_ADD, fd, &event) == -1))
+			err(1, "epoll_ctl()");
+	} else {
+		if (epoll_ctl(events.epollFd, EPOLL_CTL_DEL, fd, &event) == -1 &&
+		    errno != ENOENT && errno != EBADF)
+			err(1, "epoll_ctl()");
+	}
+#else
+	for (i = 0; i < events.nFds; i++)
+		if (events.fds[i].fd == fd)
+			break;
+	if (readable || writable) {
+		if (i == events.nFds) {
+			assert(events.nFds < MAX_EVENT_FDS);
+			events.fds[i].fd = fd;
+			events.fds[i].revents = 0;
+			events.nFds++;
+		}
+		events.fds[i].events = (readable ? POLLIN : 0) |
+				       (writable ? POLLOUT : 0);
+	} else if (i < events.nFds)
+		events.fds[i] = events.fds[--events.nFds];
+#endif
+}
+
+/* timeout in msec., -1 to wait until an event arrives */
+static int waitEvents(int timeout)
+{
+	int r;
+
+	assert(initialized);
+
+#ifdef HAVE_SYS_EPOLL_H
+	r = epoll_wait(events.epollFd, events.ready, MAX_EVENT_FDS, timeout);
+	events.nReady = (r > 0) ? r : 0;
+#else
+	r = poll(events.fds, events.nFds, timeout);
+#endif
+	return r;
+}
+
+static bool isEventWritable(int fd)
+{
+	int i;
+
+	assert(initialized);
+
+#ifdef HAVE_SYS_EPOLL_H
+	for (i = 0; i < events.nReady; i++)
+		if (events.ready[i].data.fd == fd)
+			return (events.ready[i].events &
+				(EPOLLOUT | EPOLLERR)) != 0;
+#else
+	for (i = 0; i < events.nFds; i++)
+		if (events.fds[i].fd == fd)
+			return (events.fds[i].revents &
+				(POLLOUT | POLLERR)) != 0;
+#endif
+	return false;
+}
+
+static bool isEventReady(int fd)
+{
+	int i;
+
+	assert(initialized);
+
+#ifdef HAVE_SYS_EPOLL_H
+	for (i = 0; i < events.nReady; i++)
+		if (events.ready[i].data.fd == fd)
+			return (events.ready[i].events &
+				(EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+#else
+	for (i = 0; i < events.nFds; i++)
+		if (events.fds[i].fd == fd)
+			return (events.fds[i].revents &
+				(POLLIN | POLLHUP | POLLERR)) != 0;
+#endif
+	return false;
 }
 
 void term_execute(const char *shell, char *const args[], const char *name)
@@ -339,6 +666,9 @@ void term_execute(const char *shell, char *const args[], const char *name)
 		on = 1;
 		if (ioctl(self->masterPty, TIOCPKT, &on) == -1)
 			err(1, "ioctl(TIOCPKT)");
+		if (fcntl(self->masterPty, F_SETFL,
+			  fcntl(self->masterPty, F_GETFL) | O_NONBLOCK) == -1)
+			err(1, "fcntl(O_NONBLOCK)");
 		consoleHandler();
 	}
 	/* NOTREACHED */
@@ -347,6 +677,7 @@ void term_execute(const char *shell, char *const args[], const char *name)
 static void executeShell(const char *shell, char *const args[],
 			 const char *name)
 {
+	sigset_t set;
 	int i;
 
 	assert(initialized);
@@ -365,56 +696,69 @@ static void executeShell(const char *shell, char *const args[],
 	privilege_drop();
 	for (i = getdtablesize(); i > STDERR_FILENO; i--)
 		close(i);
+	sigemptyset(&set);
+	sigaddset(&set, CONSOLE_RELEASE_SIGNAL);
+	sigaddset(&set, CONSOLE_ACQUIRE_SIGNAL);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
 	execvp(shell, args);
 	exit(EXIT_FAILURE);
 	/* NOTREACHED */
 }
 
 #define BUF_SIZE (1024)
+#define KEYMAP_EXPANSION (4) /* at most; "\177" becomes "\033[3~" */
 
 static void consoleHandler(void)
 {
 	int r;
 	ssize_t nbytes;
-	struct timeval timeout;
-	u_char buf[BUF_SIZE + 1];
-	fd_set readFds;
+	u_char in[BUF_SIZE];
+	u_char buf[BUF_SIZE * KEYMAP_EXPANSION + 1];
 
 	assert(initialized);
 
 #if defined (__linux__)
 	keyboard_enableScrollBack(false);
 #endif
-	FD_ZERO(&orgReadFds);
-	FD_SET(STDIN_FILENO, &orgReadFds);
-	FD_SET(self->masterPty, &orgReadFds);
+	initializeEvents();
+	watchEvent(STDIN_FILENO, true, false);
+	watchEvent(self->masterPty, true, false);
+	watchEvent(signalFd, true, false);
+	vterm_startRenderer(&(self->vterm));
 	if (mouse_isEnable())
 		mouse_start();
 	if (mouse_getFd() != -1)
 		enableMouse();
 	else
 		disableMouse();
+	r = 0;
 	for (;;) {
 		do {
-			/* Idle loop. */
+			/* Idle loop: sleep until the next cursor deadline. */
+			if (r == 0)
+				keyboard_updateState(); /* LEDs may change unseen */
 			vterm_pollCursor(&(self->vterm), false);
-			readFds = orgReadFds;
-			timeout.tv_sec  = 0;
-			timeout.tv_usec = 100000; /* 0.1 sec. */
-			r = select(numFds, &readFds, NULL, NULL, &timeout);
+			if (outputSuspended && !keyboard_isScrollLocked())
+				suspendOutput(false);
+			vterm_unlock(&(self->vterm));
+			r = waitEvents(getEventTimeout());
+			vterm_lock(&(self->vterm));
 		} while (r == 0 || (r == -1 && (errno == EINTR || mouse_getFd() == -1)));
 		if (r == -1)
-			err(1, "select()");
-		if (FD_ISSET(STDIN_FILENO, &readFds)) {
-			nbytes = read(STDIN_FILENO, buf, BUF_SIZE);
-#if defined (__FreeBSD__)
-			nbytes = sysconsTolinux(buf, nbytes, BUF_SIZE);
-#elif defined (__NetBSD__) || defined (__OpenBSD__)
-			nbytes = wsconsTolinux(buf, nbytes, BUF_SIZE);
+#ifdef HAVE_SYS_EPOLL_H
+			err(1, "epoll_wait()");
+#else
+			err(1, "poll()");
 #endif
-			if (((&self->vterm))->cursor)
-				nbytes = applicationCursor(buf, nbytes,
-							   BUF_SIZE);
+		if (isEventReady(signalFd))
+			handleSignals();
+		if (isEventReady(STDIN_FILENO)) {
+			keyboard_updateState();
+			nbytes = read(STDIN_FILENO, in, sizeof(in));
+			if (nbytes > 0)
+				nbytes = translateInput(in, nbytes, buf,
+							sizeof(buf) - 1);
 			if (nbytes > 0) {
 				/* Scroll Lock + Page Up */
 				bool scrollLocked, shiftPressed;
@@ -455,28 +799,23 @@ static void consoleHandler(void)
 							&(self->vterm));
 					continue;
 				}
-				write_wrapper(self->masterPty, buf, nbytes);
+				term_write((const char *)buf, nbytes);
 			}
 			vterm_pollCursor(&(self->vterm), true);
 		}
-		if (FD_ISSET(self->masterPty, &readFds)) {
-			bool scrollLocked;
-			scrollLocked = keyboard_isScrollLocked();
-			if (scrollLocked)
-				usleep(10000); /* 0.01 sec. */
-			else {
-				nbytes = read(self->masterPty, buf, BUF_SIZE);
-				if (nbytes > 0 && buf[0] == TIOCPKT_DATA) {
-					vterm_scroll_reset(&(self->vterm));
-					vterm_emulate(&(self->vterm),
-						      &buf[1], nbytes - 1);
-					vterm_refresh(&(self->vterm));
-				}
-			}
+		if (isEventWritable(self->masterPty))
+			writePaste();
+		if (isEventReady(self->masterPty)) {
+			keyboard_pollState();
+			if (keyboard_isScrollLocked())
+				suspendOutput(true);
+			else
+				readPseudoTerminal();
 		}
 		if (mouse_isEnable() && mouse_getFd() != -1) {
-			if (FD_ISSET(mouse_getFd(), &readFds) &&
+			if (isEventReady(mouse_getFd()) &&
 			    ((&self->vterm))->active) {
+				keyboard_updateState();
 				mouse_getPackets(&(self->vterm));
 				vterm_pollCursor(&(self->vterm), true);
 			}
@@ -485,6 +824,153 @@ static void consoleHandler(void)
 	/* NOTREACHED */
 }
 
+/*
+ * Drain the master pty until it would block, then refresh once.  At most
+ * PTY_BUF_MAX bytes are taken per call so that a program which never
+ * stops writing cannot starve the keyboard.
+ */
+static void readPseudoTerminal(void)
+{
+	ssize_t nbytes;
+	size_t total;
+	u_char *buf;
+	bool dirty;
+
+	assert(initialized);
+
+	dirty = false;
+	total = 0;
+	while (total < PTY_BUF_MAX) {
+		nbytes = read(self->masterPty, pty.buf, pty.size);
+		if (nbytes == -1 && errno == EINTR)
+			continue;
+		if (nbytes <= 0)
+			break; /* EAGAIN, or EIO once the slave is closed */
+		total += nbytes;
+		/* control packets (flush, stop, start) carry no data */
+		if (pty.buf[0] == TIOCPKT_DATA && nbytes > 1) {
+			if (!dirty)
+				vterm_scroll_reset(&(self->vterm));
+			vterm_emulate(&(self->vterm),
+				      &(pty.buf[1]), nbytes - 1);
+			dirty = true;
+		}
+		if ((size_t)nbytes == pty.size && pty.size < PTY_BUF_MAX) {
+			buf = realloc(pty.buf, pty.size * 2);
+			if (buf == NULL)
+				err(1, "realloc()");
+			pty.buf = buf;
+			pty.size *= 2;
+		}
+	}
+	if (dirty)
+		vterm_requestRefresh(&(self->vterm));
+}
+
+static void suspendOutput(bool suspend)
+{
+	assert(initialized);
+
+	if (suspend == outputSuspended)
+		return;
+	outputSuspended = suspend;
+	watchPseudoTerminal();
+}
+
+/* the master pty is read unless suspended, and written while pasting */
+static void watchPseudoTerminal(void)
+{
+	assert(initialized);
+
+	watchEvent(self->masterPty, !outputSuspended, paste.head < paste.tail);
+}
+
+void term_paste(const char *text, size_t length)
+{
+	u_char *buf;
+	size_t size;
+
+	assert(initialized);
+	assert(text != NULL);
+
+	if (length == 0)
+		return;
+	if (paste.head > 0) {
+		memmove(paste.buf, paste.buf + paste.head,
+			paste.tail - paste.head);
+		paste.tail -= paste.head;
+		paste.head = 0;
+	}
+	if (paste.tail + length > paste.size) {
+		size = (paste.size > 0) ? paste.size : PASTE_CHUNK;
+		while (size < paste.tail + length)
+			size *= 2;
+		buf = realloc(paste.buf, size);
+		if (buf == NULL)
+			err(1, "realloc()");
+		paste.buf = buf;
+		paste.size = size;
+	}
+	memcpy(paste.buf + paste.tail, text, length);
+	paste.tail += length;
+	watchPseudoTerminal();
+}
+
+/*
+ * Write to the master pty behind anything already queued, typed keys
+ * included, so that they go after a paste rather than into it.
+ */
+void term_write(const char *text, size_t length)
+{
+	ssize_t nbytes;
+
+	assert(initialized);
+	assert(text != NULL);
+
+	if (paste.head == paste.tail) {
+		nbytes = write_wrapper(self->masterPty, text, length);
+		text += nbytes;
+		length -= nbytes;
+	}
+	term_paste(text, length);
+}
+
+static void writePaste(void)
+{
+	ssize_t nbytes;
+	size_t length;
+
+	assert(initialized);
+
+	length = paste.tail - paste.head;
+	if (length > PASTE_CHUNK)
+		length = PASTE_CHUNK;
+	if (length > 0) {
+		nbytes = write(self->masterPty, paste.buf + paste.head, length);
+		if (nbytes > 0)
+			paste.head += nbytes;
+		else if (nbytes == -1 && errno != EAGAIN && errno != EINTR)
+			paste.head = paste.tail; /* give up */
+	}
+	if (paste.head == paste.tail) {
+		paste.head = paste.tail = 0;
+		watchPseudoTerminal();
+	}
+}
+
+static int getEventTimeout(void)
+{
+	int timeout;
+
+	assert(initialized);
+
+	timeout = vterm_getPollTimeout(&(self->vterm));
+	if (outputSuspended &&
+	    (timeout == -1 || timeout > OUTPUT_RESUME_INTERVAL))
+		timeout = OUTPUT_RESUME_INTERVAL;
+	return timeout;
+}
+
 static void writeLoginRecord(void)
 {
 #if defined (__linux__)
@@ -707,319 +1193,153 @@ static void eraseLoginRecord(void)
 #endif
 }
 
-size_t strrep(u_char *p, size_t len, size_t maxlen, size_t oldlen,
-	      const char *newstr)
-{
-	size_t newlen;
-	ssize_t copylen, diff;
-
-	assert(p != NULL);
-	assert(newstr != NULL);
-
-	newlen = strlen(newstr);
-	diff = newlen - oldlen;
-	copylen = len - oldlen;
-	if (len + diff > maxlen) {
-		diff -= (len + diff - maxlen);
-		copylen = maxlen - newlen;
-	}
-	if (copylen > 0)
-		memmove(p + newlen, p + oldlen, copylen);
-	copylen = newlen;
-	if (newlen > maxlen) {
-		copylen = maxlen;
-		diff = maxlen - len;
-	}
-	if (copylen > 0)
-		memcpy(p, newstr, copylen);
-	return diff;
-}
+/*
+ * Keyboard input translation.  Each table maps what the console sends to
+ * what the Linux console would; application cursor mode is one more table
+ * on top of the platform one.  translateInput() walks the input once and
+ * writes to a separate buffer, so nothing is moved or dropped in place.
+ */
+static const TKeyMap applicationCursorMap[] = {
+	{ "\033[A", "\033OA" },     /* Up */
+	{ "\033[B", "\033OB" },     /* Down */
+	{ "\033[C", "\033OC" },     /* Right */
+	{ "\033[D", "\033OD" },     /* Left */
+	{ NULL,     NULL     }
+};
+
+#if defined (__FreeBSD__)
+static const TKeyMap sysconsMap[] = {
+	{ "\177",   "\033[3~"  },   /* Delete */
+	{ "\033[E", "\033[G"   },   /* Center (Num Lock + 5) */
+	{ "\033[H", "\033[1~"  },   /* Home */
+	{ "\033[L", "\033[2~"  },   /* Insert */
+	{ "\033[F", "\033[4~"  },   /* End */
+	{ "\033[I", "\033[5~"  },   /* Page Up */
+	{ "\033[G", "\033[6~"  },   /* Page Down */
+	{ "\033[M", "\033[[A"  },   /* F1 */
+	{ "\033[N", "\033[[B"  },   /* F2 */
+	{ "\033[O", "\033[[C"  },   /* F3 */
+	{ "\033[P", "\033[[D"  },   /* F4 */
+	{ "\033[Q", "\033[[E"  },   /* F5 */
+	{ "\033[R", "\033[17~" },   /* F6 */
+	{ "\033[S", "\033[18~" },   /* F7 */
+	{ "\033[T", "\033[19~" },   /* F8 */
+	{ "\033[U", "\033[20~" },   /* F9 */
+	{ "\033[V", "\033[21~" },   /* F10 */
+	{ "\033[W", "\033[23~" },   /* F11 */
+	{ "\033[X", "\033[24~" },   /* F12 */
+	{ "\033[Y", "\033[25~" },   /* F13 */
+	{ "\033[Z", "\033[26~" },   /* F14 */
+	{ "\033[a", "\033[28~" },   /* F15 */
+	{ "\033[b", "\033[29~" },   /* F16 */
+	{ "\033[c", "\033[31~" },   /* F17 */
+	{ "\033[d", "\033[32~" },   /* F18 */
+	{ "\033[e", "\033[33~" },   /* F19 */
+	{ "\033[f", "\033[34~" },   /* F20 */
+	{ NULL,     NULL       }
+};
+#endif
 
-static size_t applicationCursor(u_char *buf, size_t len, size_t maxlen)
+#if defined (__NetBSD__) || defined (__OpenBSD__)
+static const TKeyMap wsconsMap[] = {
+#if defined (__NetBSD__)
+	{ "\177",     "\033[3~" },  /* Delete */
+#endif
+	{ "\033[7~",  "\033[1~" },  /* Home */
+	{ "\033[8~",  "\033[4~" },  /* End */
+	{ "\033[11~", "\033[[A" },  /* F1 */
+	{ "\033[12~", "\033[[B" },  /* F2 */
+	{ "\033[13~", "\033[[C" },  /* F3 */
+	{ "\033[14~", "\033[[D" },  /* F4 */
+	{ "\033[15~", "\033[[E" },  /* F5 */
+	{ NULL,       NULL      }
+};
+#endif
+
+/* bytes that can start an entry of any table */
+static bool keyMapLeads[UCHAR_MAX + 1];
+
+static void initializeKeyMaps(void)
 {
-	u_char *p;
-	size_t i, newlen;
+	const TKeyMap *maps[] = {
+		applicationCursorMap,
+#if defined (__FreeBSD__)
+		sysconsMap,
+#elif defined (__NetBSD__) || defined (__OpenBSD__)
+		wsconsMap,
+#endif
+		NULL
+	};
+	const TKeyMap *const *map;
+	const TKeyMap *k;
 
-	assert(initialized);
-	assert(buf != NULL);
-
-	newlen = len;
-	for (i = 0, p = buf; i < newlen; i++, p++) {
-		switch (*p) {
-		case '\033':      /* ESC */
-			if (i + 2 <= newlen && *(p + 1) == '[') {
-				switch (*(p + 2)) {
-				case 'A':        /* Up */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033OA");
-					i += 2; p += 2;
-					break;
-				case 'B':        /* Down */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033OB");
-					i += 2; p += 2;
-					break;
-				case 'C':        /* Right */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033OC");
-					i += 2; p += 2;
-					break;
-				case 'D':        /* Left */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033OD");
-					i += 2; p += 2;
-					break;
-				default:
-					i += 2; p += 2;
-					break;
-				}
-			}
-		default:
-			break;
-		}
-	}
-	return newlen;
+	for (map = maps; *map != NULL; map++)
+		for (k = *map; k->from != NULL; k++)
+			keyMapLeads[(u_char)k->from[0]] = true;
 }
 
-#if defined (__FreeBSD__)
-static size_t sysconsTolinux(u_char *buf, size_t len, size_t maxlen)
+/*
+ * Match the longest entry at in[0..len), trying the platform table before
+ * application cursor.  Returns the entry, or NULL.
+ */
+static const TKeyMap *findKeyMap(const u_char *in, size_t len)
 {
-	u_char *p;
-	size_t i, newlen;
+	const TKeyMap *maps[3];
+	const TKeyMap *const *map;
+	const TKeyMap *k, *found;
+	size_t n, foundLen;
+	int i;
 
-	assert(initialized);
-	assert(buf != NULL);
-
-	newlen = len;
-	for (i = 0, p = buf; i < newlen; i++, p++) {
-		switch (*p) {
-		case '\177':      /* Delete */
-			newlen += strrep(p, len - i, maxlen - i, 1, "\033[3~");
-			i += 3; p += 3;
-			break;
-		case '\033':      /* ESC */
-			if (i + 2 <= newlen && *(p + 1) == '[') {
-				switch (*(p + 2)) {
-				case 'E':        /* Center (Num Lock + 5) */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[G");
-					i += 2; p += 2;
-					break;
-				case 'H':        /* Home */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[1~");
-					i += 3; p += 3;
-					break;
-				case 'L':        /* Insert */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[2~");
-					i += 3; p += 3;
-					break;
-				case 'F':        /* End */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[4~");
-					i += 3; p += 3;
-					break;
-				case 'I':        /* Page Up */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[5~");
-					i += 3; p += 3;
-					break;
-				case 'G':        /* Page Down */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[6~");
-					i += 3; p += 3;
-					break;
-				case 'M':        /* F1 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[[A");
-					i += 3; p += 3;
-					break;
-				case 'N':        /* F2 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[[B");
-					i += 3; p += 3;
-					break;
-				case 'O':        /* F3 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[[C");
-					i += 3; p += 3;
-					break;
-				case 'P':        /* F4 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[[D");
-					i += 3; p += 3;
-					break;
-				case 'Q':        /* F5 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[[E");
-					i += 3; p += 3;
-					break;
-				case 'R':        /* F6 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[17~");
-					i += 4; p += 4;
-					break;
-				case 'S':        /* F7 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[18~");
-					i += 4; p += 4;
-					break;
-				case 'T':        /* F8 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[19~");
-					i += 4; p += 4;
-					break;
-				case 'U':        /* F9 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[20~");
-					i += 4; p += 4;
-					break;
-				case 'V':        /* F10 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[21~");
-					i += 4; p += 4;
-					break;
-				case 'W':        /* F11 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[23~");
-					i += 4; p += 4;
-					break;
-				case 'X':        /* F12 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[24~");
-					i += 4; p += 4;
-					break;
-				case 'Y':        /* F13 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[25~");
-					i += 4; p += 4;
-					break;
-				case 'Z':        /* F14 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[26~");
-					i += 4; p += 4;
-					break;
-				case 'a':        /* F15 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[28~");
-					i += 4; p += 4;
-					break;
-				case 'b':        /* F16 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[29~");
-					i += 4; p += 4;
-					break;
-				case 'c':        /* F17 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[31~");
-					i += 4; p += 4;
-					break;
-				case 'd':        /* F18 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[32~");
-					i += 4; p += 4;
-					break;
-				case 'e':        /* F19 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[33~");
-					i += 4; p += 4;
-					break;
-				case 'f':        /* F20 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 3, "\033[34~");
-					i += 4; p += 4;
-					break;
-				default:
-					i += 2; p += 2;
-					break;
-				}
+	i = 0;
+#if defined (__FreeBSD__)
+	maps[i++] = sysconsMap;
+#elif defined (__NetBSD__) || defined (__OpenBSD__)
+	maps[i++] = wsconsMap;
+#endif
+	if (((&self->vterm))->cursor)
+		maps[i++] = applicationCursorMap;
+	maps[i] = NULL;
+	for (map = maps; *map != NULL; map++) {
+		found = NULL;
+		foundLen = 0;
+		for (k = *map; k->from != NULL; k++) {
+			n = strlen(k->from);
+			if (n > foundLen && n <= len &&
+			    memcmp(in, k->from, n) == 0) {
+				found = k;
+				foundLen = n;
 			}
-		default:
-			break;
 		}
+		if (found != NULL)
+			return found;
 	}
-	return newlen;
+	return NULL;
 }
-#endif
 
-#if defined (__NetBSD__) || defined (__OpenBSD__)
-static size_t wsconsTolinux(u_char *buf, size_t len, size_t maxlen)
+static size_t translateInput(const u_char *in, size_t len,
+			     u_char *out, size_t maxlen)
 {
-	u_char *p;
-	size_t i, newlen;
-	int n;
+	const TKeyMap *k;
+	size_t i, o, n;
 
 	assert(initialized);
-	assert(buf != NULL);
+	assert(in != NULL);
+	assert(out != NULL);
 
-	newlen = len;
-	for (i = 0, p = buf; i < newlen; i++, p++) {
-		switch (*p) {
-#if defined (__NetBSD__)
-		case '\177':      /* Delete */
-			newlen += strrep(p, len - i, maxlen - i, 1, "\033[3~");
-			i += 3; p += 3;
-			break;
-#endif
-		case '\033':      /* ESC */
-			if (i + 3 <= newlen && *(p + 1) == '[' &&
-			    *(p + 3) == '~') {
-				switch (*(p + 2)) {
-				case '7':        /* Home */
-					newlen += strrep(p, len - i, maxlen - i,
-							 4, "\033[1~");
-					i += 3; p += 3;
-					break;
-				case '8':        /* End */
-					newlen += strrep(p, len - i, maxlen - i,
-							 4, "\033[4~");
-					i += 3; p += 3;
-					break;
-				default:
-					i += 3; p += 3;
-					break;
-				}
-			} else if (i + 4 <= newlen && *(p + 1) == '[' &&
-				   isdigit(*(p + 2)) && isdigit(*(p + 3)) &&
-				   *(p + 4) == '~') {
-				n = hex2int(*(p + 2)) * 10 + hex2int(*(p + 3));
-				switch (n) {
-				case 11:         /* F1 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 5, "\033[[A");
-					i += 3; p += 3;
-					break;
-				case 12:         /* F2 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 5, "\033[[B");
-					i += 3; p += 3;
-					break;
-				case 13:         /* F3 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 5, "\033[[C");
-					i += 3; p += 3;
-					break;
-				case 14:         /* F4 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 5, "\033[[D");
-					i += 3; p += 3;
-					break;
-				case 15:         /* F5 */
-					newlen += strrep(p, len - i, maxlen - i,
-							 5, "\033[[E");
-					i += 3; p += 3;
-					break;
-				default:
-					i += 4; p += 4;
-					break;
-				}
-			}
-		default:
-			break;
+	for (i = 0, o = 0; i < len; ) {
+		if (keyMapLeads[in[i]] &&
+		    (k = findKeyMap(&in[i], len - i)) != NULL) {
+			n = strlen(k->to);
+			if (o + n > maxlen)
+				break;
+			memcpy(&out[o], k->to, n);
+			o += n;
+			i += strlen(k->from);
+		} else {
+			if (o >= maxlen)
+				break;
+			out[o++] = in[i++];
 		}
 	}
-	return newlen;
+	return o;
 }
-#endif
-
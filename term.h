@@ -69,6 +69,8 @@ typedef struct Raw_TTerm {
 void term_initialize(TCaps *caps, u_int history, const char *encoding,
 		     int ambiguous);
 void term_execute(const char *shell, char *const args[], const char *name);
+void term_paste(const char *text, size_t length);
+void term_write(const char *text, size_t length);
 
 #endif /* INCLUDE_TERM_H */
 
@@ -225,11 +225,13 @@ ssize_t write_wrapper(int fd, const void *buf, size_t nbytes)
 
 	total = 0;
 	while (total < nbytes) {
-		n = write(fd, buf, nbytes - total);
-		if (n == -1) n = 0;
-		total += n;
-		if (errno != EINTR)
+		n = write(fd, (const char *)buf + total, nbytes - total);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
 			break;
+		}
+		total += n;
 	}
 	return total;
 }
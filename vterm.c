@@ -109,6 +109,8 @@ static void vterm_set_mode(TVterm *p, int value, bool question, bool flag);
 static void vterm_esc_report(TVterm *p, u_char c, int value);
 static void vterm_set_region(TVterm *p, int ymin, int ymax);
 static void vterm_set_window_size(TVterm *p);
+static void vterm_allocate_screen(TScreen *s, u_int rows, u_int cols4);
+static void vterm_free_screen(TScreen *s);
 static void vterm_esc_status_line(TVterm *p, u_char c);
 static void vterm_esc_bracket(TVterm *p, u_char c);
 static void vterm_esc_rbracket(TVterm *p, u_char c);
@@ -141,12 +143,14 @@ void vterm_initialize(TVterm *p, TTerm *term, TCaps *caps, u_int history,
 	p->savedPenSL = NULL;
 	p->statusLine = VTERM_STATUS_LINE_NONE;
 	p->mouseTracking = VTERM_MOUSE_TRACKING_NONE;
+	p->selection.active = false;
 	p->gDefaultL = 0;
 	p->gDefaultR = 1;
 	p->gDefaultIdx[0] = 0;                  /* G0 <== ASCII */
 	p->gDefaultIdx[1] = 1;                  /* G1 <== JIS X 0208 */
 	p->gDefaultIdx[2] = 0;                  /* G2 <== ASCII */
 	p->gDefaultIdx[3] = 0;                  /* G3 <== ASCII */
+	p->acsIdx = font_getIndexBySignature(0x30 | FONT_SIGNATURE_94CHAR);
 	p->escSignature = 0;
 	p->escGn = 0;
 	p->gIdx[0] = 0;
@@ -170,6 +174,9 @@ void vterm_initialize(TVterm *p, TTerm *term, TCaps *caps, u_int history,
 	p->wrap = false;
 	p->insert = false;
 	p->cursor = false;
+	p->bracketedPaste = false;
+	p->altScreen = false;
+	p->syncUpdate = false;
 	p->active = true;
 	p->textClear = true;
 	p->esc = NULL;
@@ -191,6 +198,7 @@ void vterm_initialize(TVterm *p, TTerm *term, TCaps *caps, u_int history,
 	p->flag = calloc(p->tsize, sizeof(uint8_t));
 	if (p->flag == NULL)
 		err(1, "calloc()");
+	vterm_allocate_screen(&(p->other), p->rows, p->cols4);
 	vterm_set_default_encoding(p, encoding);
 	vterm_set_default_invoke_and_designate(p);
 	vterm_set_window_size(p);
@@ -198,6 +206,7 @@ void vterm_initialize(TVterm *p, TTerm *term, TCaps *caps, u_int history,
 
 void vterm_finalize(TVterm *p)
 {
+	vterm_stopRenderer(p);
 	p->active = false;
 	pen_finalize(&(p->pen));
 	if (p->savedPen != NULL) {
@@ -241,6 +250,49 @@ void vterm_finalize(TVterm *p)
 		free(p->flag);
 		p->flag = NULL;
 	}
+	vterm_free_screen(&(p->other));
+}
+
+/* the alternate screen has no history */
+static void vterm_allocate_screen(TScreen *s, u_int rows, u_int cols4)
+{
+	s->history = 0;
+	s->historyTop = 0;
+	s->tsize = rows * cols4;
+	s->text = calloc(s->tsize, sizeof(uint16_t));
+	if (s->text == NULL)
+		err(1, "calloc()");
+	s->fontIndex = calloc(s->tsize, sizeof(u_int));
+	if (s->fontIndex == NULL)
+		err(1, "calloc()");
+	s->rawText = calloc(s->tsize, sizeof(uint16_t));
+	if (s->rawText == NULL)
+		err(1, "calloc()");
+	s->foreground = calloc(s->tsize, sizeof(uint8_t));
+	if (s->foreground == NULL)
+		err(1, "calloc()");
+	s->background = calloc(s->tsize, sizeof(uint8_t));
+	if (s->background == NULL)
+		err(1, "calloc()");
+	s->flag = calloc(s->tsize, sizeof(uint8_t));
+	if (s->flag == NULL)
+		err(1, "calloc()");
+}
+
+static void vterm_free_screen(TScreen *s)
+{
+	free(s->text);
+	s->text = NULL;
+	free(s->fontIndex);
+	s->fontIndex = NULL;
+	free(s->rawText);
+	s->rawText = NULL;
+	free(s->foreground);
+	s->foreground = NULL;
+	free(s->background);
+	s->background = NULL;
+	free(s->flag);
+	s->flag = NULL;
 }
 
 static bool parse_encoding(const char *encoding, int idx[6])
@@ -1282,6 +1334,9 @@ static void vterm_esc_start(TVterm *p, u_char c)
 		pen_resetAttribute(&(p->pen));
 		p->wrap = false;
 		vterm_set_default_invoke_and_designate(p);
+		vterm_switchScreen(p, false);
+		p->bracketedPaste = false;
+		vterm_setSyncUpdate(p, false);
 		/* fail into next case */
 		/* TERM_CAH: - conflicts with ISO_G2D4, no terminfo */
 		p->pen.x = 0;
@@ -1338,8 +1393,6 @@ static void vterm_esc_start(TVterm *p, u_char c)
 
 static void vterm_esc_set_attr(TVterm *p, int value)
 {
-	static int acsIdx;
-
 	switch (value) {
 	case 0:
 		pen_resetAttribute(&(p->pen));
@@ -1370,11 +1423,8 @@ static void vterm_esc_set_attr(TVterm *p, int value)
 		p->altCs = false;
 		break;
 	case 11: /* smacs, smpch */
-		if (acsIdx == 0)
-			acsIdx = font_getIndexBySignature(0x30 |
-						FONT_SIGNATURE_94CHAR);
-		if (acsIdx > 0) {
-			p->gIdx[0] = acsIdx;
+		if (p->acsIdx > 0) {
+			p->gIdx[0] = p->acsIdx;
 			vterm_re_invoke_gx(p, &(p->gl));
 			vterm_re_invoke_gx(p, &(p->gr));
 			p->tgl = p->gl; p->tgr = p->gr;
@@ -1420,6 +1470,25 @@ static void vterm_set_mode(TVterm *p, int value, bool question, bool flag)
 			cursor_show(p, &cursor, flag);
 		}
 		break;
+	case 47:
+	case 1047:
+	case 1049:
+		if (!question)
+			break;
+		if (flag && !p->altScreen) {
+			if (value == 1049)
+				vterm_push_current_pen(p, true);
+			vterm_switchScreen(p, true);
+			if (value == 1049)
+				vterm_text_clear_all(p);
+		} else if (!flag && p->altScreen) {
+			if (value == 1047)
+				vterm_text_clear_all(p);
+			vterm_switchScreen(p, false);
+			if (value == 1049)
+				vterm_pop_pen_and_set_current_pen(p, true);
+		}
+		break;
 	case 1000:
 		if (question)
 			p->mouseTracking = flag ?
@@ -1438,6 +1507,14 @@ static void vterm_set_mode(TVterm *p, int value, bool question, bool flag)
 				VTERM_MOUSE_TRACKING_ANY_EVENT :
 				VTERM_MOUSE_TRACKING_NONE;
 		break;
+	case 2004:
+		if (question)
+			p->bracketedPaste = flag;
+		break;
+	case 2026:
+		if (question)
+			vterm_setSyncUpdate(p, flag);
+		break;
 	default:
 		break;
 	}
@@ -1482,7 +1559,7 @@ static void vterm_esc_report(TVterm *p, u_char c, int value)
 		break;
 	}
 	if (strlen(report) > 0)
-		write_wrapper(p->term->masterPty, report, strlen(report));
+		term_write(report, strlen(report));
 }
 
 static void vterm_set_region(TVterm *p, int ymin, int ymax)
@@ -1861,6 +1938,7 @@ static void vterm_esc_designate_font(TVterm *p, u_char c)
 	if (vterm_is_ISO2022(p)) {
 		i = font_getIndexBySignature(c | p->escSignature);
 		if (i >= 0) {
+			font_load(&(gFonts[i]));
 			p->gIdx[p->escGn] = i;
 			vterm_re_invoke_gx(p, &(p->gl));
 			vterm_re_invoke_gx(p, &(p->gr));
@@ -82,6 +82,28 @@ typedef struct Raw_TCodingSystem {
 #define VTERM_FLAG_2COLUMN_2    (0x40) /* 2 column 2nd */
 #define VTERM_FLAG_CLEAN        (0x80) /* skip draw */
 
+/* a stream of cells drawn reversed, in screen coordinates */
+typedef struct Raw_TSelection {
+	bool active;
+	u_int sx;
+	u_int sy;
+	u_int ex;
+	u_int ey;
+} TSelection;
+
+/* the cells of a screen, and the history kept above them */
+typedef struct Raw_TScreen {
+	u_int history;
+	u_int historyTop;
+	u_int tsize;
+	uint16_t *text;
+	u_int *fontIndex;
+	uint16_t *rawText;
+	uint8_t *foreground;
+	uint8_t *background;
+	uint8_t *flag;
+} TScreen;
+
 typedef struct Raw_TVterm {
 	struct Raw_TTerm *term;
 	TCaps *caps;
@@ -112,10 +134,12 @@ typedef struct Raw_TVterm {
 		VTERM_MOUSE_TRACKING_BTN_EVENT,
 		VTERM_MOUSE_TRACKING_ANY_EVENT
 	} mouseTracking;
+	TSelection selection;
 	/* ISO-2022 */
 	u_int gDefaultL;
 	u_int gDefaultR;
 	u_int gDefaultIdx[4];
+	int acsIdx;
 	u_int escSignature;
 	u_int escGn;
 	u_int gIdx[4];  /* Gn˻ؼƤʸgFonts[]Ǥΰ */
@@ -140,6 +164,10 @@ typedef struct Raw_TVterm {
 	bool wrap;
 	bool insert;
 	bool cursor;
+	bool bracketedPaste;
+	bool altScreen;
+	bool syncUpdate;
+	struct timeval syncTimer;
 	bool active;
 	bool textClear;
 	void (*esc)(struct Raw_TVterm *p, u_char c);
@@ -149,6 +177,7 @@ typedef struct Raw_TVterm {
 	uint8_t *foreground;
 	uint8_t *background;
 	uint8_t *flag;
+	TScreen other;  /* the screen which is not shown */
 } TVterm;
 
 void vterm_initialize(TVterm *p, struct Raw_TTerm *term, TCaps *caps,
@@ -47,15 +47,20 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iconv.h>
-#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 #include "clipboard.h"
 #include "cursor.h"
@@ -69,6 +74,88 @@
 #include "vterm.h"
 #include "vtermlow.h"
 
+#define COPY_BUF_SIZE (4096)
+
+/* how copyCode() takes a code into the run being copied */
+typedef enum {
+	COPY_TEXT,              /* a byte as it is */
+	COPY_UTF8,              /* UCS-2, encoded to UTF-8 here */
+	COPY_MULTIBYTE,         /* a 2 byte code, converted by mbcd */
+	COPY_UNICODE            /* UCS-2, converted by uccd */
+} COPY_MODE;
+
+/* the cells being copied to the clipboard, as a run of one mode */
+static struct {
+	COPY_MODE mode;
+	iconv_t mbcd;
+	iconv_t uccd;
+	char *buf;
+	size_t length;
+	size_t size;
+} copy;
+
+/* a synchronized update is drawn as it stands after this long */
+#define SYNC_UPDATE_TIMEOUT (150) /* msec. */
+
+/* the dirty cells of the screen, copied out of the vterm to be drawn */
+static struct {
+	u_int cols;
+	u_int rows;
+	uint16_t *text;
+	u_int *fontIndex;
+	uint8_t *foreground;
+	uint8_t *background;
+	uint8_t *flag;
+	u_int damage;         /* dirty cells */
+	bool textClear;
+	bool cursor;
+	u_int x;
+	u_int y;
+	bool wide;
+	TCursorCell under;    /* the cell under the text cursor */
+} snapshot;
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * With a render thread, the event loop holds lock except while it sleeps
+ * or waits for the renderer.  The renderer takes a snapshot under lock,
+ * then draws it without lock, so that parsing never waits for drawing.
+ */
+static struct {
+	bool enable;
+	bool threaded;
+	bool quit;
+	bool idle;            /* the renderer waits for a request */
+	volatile bool wanted; /* the renderer waits for lock */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	u_int requested;
+	u_int completed;
+	u_int snapshots;
+} render;
+
+/*
+ * Large refreshes are split into bands of rows drawn by a pool of
+ * workers.  Bands own disjoint scanlines, so the workers share nothing
+ * but the glyphs, which are loaded before the bands are handed out.
+ */
+#define MAX_BAND_WORKERS (16)
+#define BAND_MIN_PIXELS  (512 * 1024) /* less is drawn by one thread */
+
+static struct {
+	u_int count;          /* bands; this thread draws the first */
+	bool quit;
+	pthread_t threads[MAX_BAND_WORKERS];
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t finish;
+	u_int generation;
+	u_int pending;
+} bands;
+#endif
+
 static inline u_int coordToIndex(TVterm *p, u_int x, u_int y);
 static inline bool isLeadChar(TVterm *p, u_int x, u_int y);
 static inline bool isTailChar(TVterm *p, u_int x, u_int y);
@@ -86,6 +173,36 @@ static inline void vterm_clear(TVterm *p, int top, int n);
 static void vterm_text_clean_band(TVterm *p, u_int top, u_int bottom);
 static void vterm_add_history(TVterm *p, int line);
 static void pollMouseCursor(TVterm *p);
+static void saveScreen(TVterm *p, TScreen *s);
+static void loadScreen(TVterm *p, TScreen *s);
+static void reverseColors(uint8_t *foreground, uint8_t *background);
+static bool getSelectionSpan(TVterm *p, TSelection *s, u_int y,
+			     u_int *from, u_int *to);
+static bool isSelected(TVterm *p, u_int i, u_int x, u_int y);
+static void uncleanSelection(TVterm *p, TSelection *old);
+static void copyCode(COPY_MODE mode, uint16_t code);
+static void flushCopy(void);
+static inline int minTimeout(int timeout, int next);
+static int getSyncTimeout(TVterm *p);
+static void pollCursor(TVterm *p, bool wakeup);
+static void allocateSnapshot(TVterm *p);
+static void freeSnapshot(void);
+static void takeSnapshot(TVterm *p);
+static void drawSnapshot(TVterm *p);
+static TFont *getCellFont(u_int j, bool *doubleColumn);
+static void getCell(TVterm *p, u_int x, u_int y, TCursorCell *cell);
+static void getSnapshotCell(u_int j, TCursorCell *cell);
+static bool isSnapshotDirty(u_int x, u_int y);
+static void drawRows(u_int top, u_int bottom);
+#ifdef HAVE_LIBPTHREAD
+static void configRenderThread(const char *config);
+static void configRenderWorkers(const char *config);
+static void *renderer(void *arg);
+static void startBands(void);
+static void stopBands(void);
+static void drawBands(void);
+static void *bandWorker(void *arg);
+#endif
 
 static inline u_int coordToIndex(TVterm *p, u_int x, u_int y)
 {
@@ -223,62 +340,550 @@ void vterm_insert_n_chars(TVterm *p, int n)
 	vterm_clear(p, i, n);
 }
 
-void vterm_refresh(TVterm *p)
+static void allocateSnapshot(TVterm *p)
 {
-	TFont *font;
-	u_int i, x, y;
-	sigset_t set, oldset;
-	bool underline, doubleColumn;
+	size_t n;
+
+	freeSnapshot();
+	n = p->cols * p->rows;
+	snapshot.text = malloc(n * sizeof(uint16_t));
+	snapshot.fontIndex = malloc(n * sizeof(u_int));
+	snapshot.foreground = malloc(n * sizeof(uint8_t));
+	snapshot.background = malloc(n * sizeof(uint8_t));
+	snapshot.flag = malloc(n * sizeof(uint8_t));
+	if (snapshot.text == NULL || snapshot.fontIndex == NULL ||
+	    snapshot.foreground == NULL || snapshot.background == NULL ||
+	    snapshot.flag == NULL)
+		err(1, "malloc()");
+	snapshot.cols = p->cols;
+	snapshot.rows = p->rows;
+}
 
-	sigemptyset(&set);
-	sigaddset(&set, SIGUSR1);
-	sigprocmask(SIG_SETMASK, &set, &oldset);
-	if (!p->active) {
-		sigprocmask(SIG_SETMASK, &oldset, NULL);
-		return;
-	}
-	cursor_show(p, &cursor, false);
-	cursor_show(p, &mouseCursor, false);
-	if (p->textClear) {
-		gFramebuffer.accessor.fill(&gFramebuffer,
-					   0, 0,
-					   gFramebuffer.width,
-					   gFramebuffer.height,
-					   0);
-		p->textClear = false;
-	}
-	doubleColumn = false;
+static void freeSnapshot(void)
+{
+	free(snapshot.text);
+	snapshot.text = NULL;
+	free(snapshot.fontIndex);
+	snapshot.fontIndex = NULL;
+	free(snapshot.foreground);
+	snapshot.foreground = NULL;
+	free(snapshot.background);
+	snapshot.background = NULL;
+	free(snapshot.flag);
+	snapshot.flag = NULL;
+	snapshot.cols = 0;
+	snapshot.rows = 0;
+}
+
+/* copy the dirty cells out and mark them clean */
+static void takeSnapshot(TVterm *p)
+{
+	u_int i, j, x, y;
+
+	if (snapshot.cols != p->cols || snapshot.rows != p->rows)
+		allocateSnapshot(p);
+	snapshot.textClear = p->textClear;
+	p->textClear = false;
+	snapshot.damage = 0;
+	j = 0;
 	for (y = 0; y < p->rows; y++) {
-		for (x = 0; x < p->cols; x++) {
+		for (x = 0; x < p->cols; x++, j++) {
 			i = coordToIndexH(p, x, y);
+			snapshot.flag[j] = p->flag[i];
 			if (p->flag[i] & VTERM_FLAG_CLEAN)
 				continue; /* already clean */
 			p->flag[i] |= VTERM_FLAG_CLEAN;
-			if (p->flag[i] & VTERM_FLAG_1COLUMN) {
-				font = &(gFonts[p->fontIndex[i]]);
-				doubleColumn = false;
-			} else if (p->flag[i] & VTERM_FLAG_2COLUMN_1) {
-				font = &(gFonts[p->fontIndex[i]]);
-				doubleColumn = true;
+			if (p->flag[i] & VTERM_FLAG_2COLUMN_1)
 				p->flag[i + 1] |= VTERM_FLAG_CLEAN;
-			} else {
-				font = &(gFonts[0]);
-				doubleColumn = false;
-			}
-			underline = (p->flag[i] & VTERM_FLAG_UNDERLINE);
-			font_draw(font, p->text[i], p->foreground[i],
-				  p->background[i], x, y,
-				  underline, doubleColumn);
+			snapshot.damage++;
+			snapshot.text[j] = p->text[i];
+			snapshot.fontIndex[j] = p->fontIndex[i];
+			snapshot.foreground[j] = p->foreground[i];
+			snapshot.background[j] = p->background[i];
+			if (isSelected(p, i, x, y))
+				reverseColors(&(snapshot.foreground[j]),
+					      &(snapshot.background[j]));
 		}
 	}
 	/* XXX: pen position go out of screen by resize(1) for example */
-	if (p->top == 0 && p->pen.x < p->cols && p->pen.y < p->rows) {
-		cursor.wide = isLeadChar(p, p->pen.x, p->pen.y);
-		cursor.x = p->pen.x;
-		cursor.y = p->pen.y;
+	snapshot.cursor = (p->top == 0 &&
+			   p->pen.x < p->cols && p->pen.y < p->rows);
+	if (snapshot.cursor) {
+		snapshot.x = p->pen.x;
+		snapshot.y = p->pen.y;
+		/* the cursor covers the whole of a wide character */
+		adjustCoord(p, &(snapshot.x), &(snapshot.y));
+		snapshot.wide = isLeadChar(p, snapshot.x, snapshot.y);
+		getCell(p, snapshot.x, snapshot.y, &(snapshot.under));
+	}
+}
+
+/*
+ * Cursors are drawn from the cells under them, so cells drawn over a
+ * cursor just take it off the screen.  A cursor is redrawn only if its
+ * cell was, or if it moves.
+ */
+static void drawSnapshot(TVterm *p)
+{
+	bool mouseShown;
+
+	if (!snapshot.cursor || cursor.x != snapshot.x ||
+	    cursor.y != snapshot.y || cursor.wide != snapshot.wide)
+		cursor_show(p, &cursor, false);
+	mouseShown = mouseCursor.shown;
+	if (snapshot.textClear) {
+		gFramebuffer.accessor.fill(&gFramebuffer,
+					   0, 0,
+					   gFramebuffer.screenWidth,
+					   gFramebuffer.screenHeight,
+					   0);
+		cursor.shown = false;
+		mouseCursor.shown = false;
+	}
+#ifdef HAVE_LIBPTHREAD
+	if (bands.count > 1 &&
+	    snapshot.damage * gFontsWidth * gFontsHeight >= BAND_MIN_PIXELS)
+		drawBands();
+	else
+#endif
+		drawRows(0, snapshot.rows);
+	if (isSnapshotDirty(mouseCursor.x, mouseCursor.y)) {
+		getSnapshotCell(mouseCursor.x + mouseCursor.y * snapshot.cols,
+				&(mouseCursor.under));
+		mouseCursor.shown = false;
+		cursor_show(p, &mouseCursor, mouseShown);
+	}
+	if (snapshot.cursor) {
+		if (isSnapshotDirty(snapshot.x, snapshot.y))
+			cursor.shown = false;
+		cursor.wide = snapshot.wide;
+		cursor.x = snapshot.x;
+		cursor.y = snapshot.y;
+		cursor.under = snapshot.under;
 		cursor_show(p, &cursor, true);
 	}
-	sigprocmask(SIG_SETMASK, &oldset, NULL);
+}
+
+static TFont *getCellFont(u_int j, bool *doubleColumn)
+{
+	if (snapshot.flag[j] & VTERM_FLAG_1COLUMN) {
+		*doubleColumn = false;
+		return &(gFonts[snapshot.fontIndex[j]]);
+	} else if (snapshot.flag[j] & VTERM_FLAG_2COLUMN_1) {
+		*doubleColumn = true;
+		return &(gFonts[snapshot.fontIndex[j]]);
+	}
+	*doubleColumn = false;
+	return &(gFonts[0]);
+}
+
+/* the cell at (x, y) on the screen, as it is drawn */
+static void getCell(TVterm *p, u_int x, u_int y, TCursorCell *cell)
+{
+	u_int i;
+
+	i = coordToIndexH(p, x, y);
+	if (p->flag[i] & (VTERM_FLAG_1COLUMN | VTERM_FLAG_2COLUMN_1))
+		cell->font = &(gFonts[p->fontIndex[i]]);
+	else
+		cell->font = &(gFonts[0]);
+	cell->code = p->text[i];
+	cell->foreground = p->foreground[i];
+	cell->background = p->background[i];
+	if (isSelected(p, i, x, y))
+		reverseColors(&(cell->foreground), &(cell->background));
+	cell->underline = (p->flag[i] & VTERM_FLAG_UNDERLINE);
+}
+
+static void getSnapshotCell(u_int j, TCursorCell *cell)
+{
+	bool doubleColumn;
+
+	cell->font = getCellFont(j, &doubleColumn);
+	cell->code = snapshot.text[j];
+	cell->foreground = snapshot.foreground[j];
+	cell->background = snapshot.background[j];
+	cell->underline = (snapshot.flag[j] & VTERM_FLAG_UNDERLINE);
+}
+
+/* whether the cell at (x, y) is drawn from the snapshot */
+static bool isSnapshotDirty(u_int x, u_int y)
+{
+	if (snapshot.textClear)
+		return true;
+	if (x >= snapshot.cols || y >= snapshot.rows)
+		return false;
+	return !(snapshot.flag[x + y * snapshot.cols] & VTERM_FLAG_CLEAN);
+}
+
+static void drawRows(u_int top, u_int bottom)
+{
+	TFont *font;
+	u_int j, x, y;
+	bool underline, doubleColumn;
+
+	j = top * snapshot.cols;
+	for (y = top; y < bottom; y++) {
+		for (x = 0; x < snapshot.cols; x++, j++) {
+			if (snapshot.flag[j] & VTERM_FLAG_CLEAN)
+				continue;
+			font = getCellFont(j, &doubleColumn);
+			underline = (snapshot.flag[j] & VTERM_FLAG_UNDERLINE);
+			font_draw(font, snapshot.text[j],
+				  snapshot.foreground[j],
+				  snapshot.background[j], x, y,
+				  underline, doubleColumn);
+		}
+	}
+}
+
+/* draw the dirty cells, and return once they are on the screen */
+void vterm_refresh(TVterm *p)
+{
+#ifdef HAVE_LIBPTHREAD
+	u_int target;
+#endif
+
+	if (!p->active)
+		return;
+#ifdef HAVE_LIBPTHREAD
+	if (render.threaded) {
+		target = ++render.requested;
+		pthread_cond_signal(&(render.wake));
+		while ((int)(render.completed - target) < 0)
+			pthread_cond_wait(&(render.done), &(render.lock));
+		return;
+	}
+#endif
+	takeSnapshot(p);
+	drawSnapshot(p);
+}
+
+/*
+ * Have the dirty cells drawn.  The render thread is waited for only while
+ * it takes its snapshot, never while it draws.
+ */
+void vterm_requestRefresh(TVterm *p)
+{
+#ifdef HAVE_LIBPTHREAD
+	u_int snapshots;
+#endif
+
+	if (p->syncUpdate) {
+		if (getSyncTimeout(p) > 0)
+			return;
+		p->syncUpdate = false;
+	}
+#ifdef HAVE_LIBPTHREAD
+	if (render.threaded) {
+		if (!p->active)
+			return;
+		render.requested++;
+		pthread_cond_signal(&(render.wake));
+		snapshots = render.snapshots;
+		while (render.snapshots == snapshots &&
+		       (render.idle || render.wanted))
+			pthread_cond_wait(&(render.done), &(render.lock));
+		return;
+	}
+#endif
+	vterm_refresh(p);
+}
+
+/*
+ * While a synchronized update (DECSET 2026) is held, the cells are left
+ * dirty rather than drawn, so the frame is drawn whole once it ends.
+ */
+void vterm_setSyncUpdate(TVterm *p, bool flag)
+{
+	if (flag && !p->syncUpdate)
+		gettimeofday(&(p->syncTimer), NULL);
+	p->syncUpdate = flag;
+}
+
+/* msec. until a synchronized update runs out of time, or -1 if none */
+static int getSyncTimeout(TVterm *p)
+{
+	struct timeval now, diff;
+	long elapsedTime;
+
+	if (!p->syncUpdate)
+		return -1;
+	timerclear(&diff);
+	gettimeofday(&now, NULL);
+	timersub(&now, &(p->syncTimer), &diff);
+	elapsedTime = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	if (elapsedTime >= SYNC_UPDATE_TIMEOUT)
+		return 0;
+	return SYNC_UPDATE_TIMEOUT - elapsedTime;
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void configRenderThread(const char *config)
+{
+	bool found;
+	int i;
+
+	static const struct {
+		const char *key;
+		const bool enable;
+	} list[] = {
+		{ "On",  true  },
+		{ "Off", false },
+		{ NULL,  false }
+	};
+
+	render.enable = false;
+	if (config != NULL) {
+		found = false;
+		for (i = 0; list[i].key != NULL; i++) {
+			if (strcasecmp(list[i].key, config) == 0) {
+				render.enable = list[i].enable;
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			warnx("Invalid render thread: %s", config);
+	}
+}
+
+static void *renderer(void *arg)
+{
+	TVterm *p;
+	u_int target;
+	bool taken;
+
+	p = arg;
+	render.wanted = true;
+	pthread_mutex_lock(&(render.lock));
+	for (;;) {
+		render.wanted = false;
+		while (render.completed == render.requested && !render.quit) {
+			render.idle = true;
+			pthread_cond_wait(&(render.wake), &(render.lock));
+			render.idle = false;
+		}
+		if (render.quit)
+			break;
+		target = render.requested;
+		taken = p->active;
+		if (taken)
+			takeSnapshot(p);
+		render.snapshots++;
+		pthread_cond_broadcast(&(render.done));
+		pthread_mutex_unlock(&(render.lock));
+		/* VT switching changes active under the framebuffer lock */
+		framebuffer_lock();
+		if (taken && p->active)
+			drawSnapshot(p);
+		framebuffer_unlock();
+		render.wanted = true;
+		pthread_mutex_lock(&(render.lock));
+		render.completed = target;
+		pthread_cond_broadcast(&(render.done));
+	}
+	pthread_mutex_unlock(&(render.lock));
+	return NULL;
+}
+
+static void configRenderWorkers(const char *config)
+{
+	long cpus;
+	int workers;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	bands.count = (cpus < 1) ? 1 :
+		      (cpus > MAX_BAND_WORKERS) ? MAX_BAND_WORKERS : cpus;
+	if (config != NULL) {
+		workers = atoi(config);
+		if (workers >= 1 && workers <= MAX_BAND_WORKERS)
+			bands.count = workers;
+		else
+			warnx("Invalid render workers: %s", config);
+	}
+}
+
+static void startBands(void)
+{
+	sigset_t set, oldset;
+	u_int i;
+
+	/*
+	 * Planar framebuffers are written through shared VGA registers, and
+	 * rotated glyphs are cached as they are drawn.
+	 */
+	if (gFramebuffer.accessor.bitsPerPixel < 8 || gFramebuffer.rotate != 0)
+		bands.count = 1;
+	if (bands.count <= 1)
+		return;
+	bands.quit = false;
+	bands.generation = 0;
+	bands.pending = 0;
+	pthread_mutex_init(&(bands.lock), NULL);
+	pthread_cond_init(&(bands.start), NULL);
+	pthread_cond_init(&(bands.finish), NULL);
+	/* signals are left to the event loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	for (i = 1; i < bands.count; i++)
+		if (pthread_create(&(bands.threads[i]), NULL,
+				   bandWorker, (void *)(uintptr_t)i) != 0)
+			break;
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	/* as many bands as there are threads to draw them */
+	bands.count = i;
+}
+
+static void stopBands(void)
+{
+	u_int i;
+
+	if (bands.count <= 1)
+		return;
+	pthread_mutex_lock(&(bands.lock));
+	bands.quit = true;
+	pthread_cond_broadcast(&(bands.start));
+	pthread_mutex_unlock(&(bands.lock));
+	for (i = 1; i < bands.count; i++)
+		pthread_join(bands.threads[i], NULL);
+	pthread_cond_destroy(&(bands.finish));
+	pthread_cond_destroy(&(bands.start));
+	pthread_mutex_destroy(&(bands.lock));
+	bands.count = 1;
+}
+
+static void drawBands(void)
+{
+	TFont *font, *loaded;
+	u_int j, n;
+	bool doubleColumn;
+
+	/* workers must not load fonts; they are behind the framebuffer lock */
+	loaded = NULL;
+	n = snapshot.cols * snapshot.rows;
+	for (j = 0; j < n; j++) {
+		if (snapshot.flag[j] & VTERM_FLAG_CLEAN)
+			continue;
+		font = getCellFont(j, &doubleColumn);
+		if (font != loaded) {
+			font_load(font);
+			loaded = font;
+		}
+	}
+	pthread_mutex_lock(&(bands.lock));
+	bands.generation++;
+	bands.pending = bands.count - 1;
+	pthread_cond_broadcast(&(bands.start));
+	pthread_mutex_unlock(&(bands.lock));
+	drawRows(0, snapshot.rows / bands.count);
+	pthread_mutex_lock(&(bands.lock));
+	while (bands.pending > 0)
+		pthread_cond_wait(&(bands.finish), &(bands.lock));
+	pthread_mutex_unlock(&(bands.lock));
+}
+
+static void *bandWorker(void *arg)
+{
+	u_int band, generation;
+
+	band = (uintptr_t)arg;
+	generation = 0;
+	pthread_mutex_lock(&(bands.lock));
+	for (;;) {
+		while (bands.generation == generation && !bands.quit)
+			pthread_cond_wait(&(bands.start), &(bands.lock));
+		if (bands.quit)
+			break;
+		generation = bands.generation;
+		pthread_mutex_unlock(&(bands.lock));
+		drawRows(snapshot.rows * band / bands.count,
+			 snapshot.rows * (band + 1) / bands.count);
+		pthread_mutex_lock(&(bands.lock));
+		if (--bands.pending == 0)
+			pthread_cond_signal(&(bands.finish));
+	}
+	pthread_mutex_unlock(&(bands.lock));
+	return NULL;
+}
+#endif
+
+void vterm_startRenderer(TVterm *p)
+{
+#ifdef HAVE_LIBPTHREAD
+	sigset_t set, oldset;
+
+	configRenderWorkers(caps_findFirst(p->caps, "render.workers"));
+	startBands();
+	configRenderThread(caps_findFirst(p->caps, "render.thread"));
+	if (!render.enable || render.threaded)
+		return;
+	render.quit = false;
+	render.idle = false;
+	render.requested = 0;
+	render.completed = 0;
+	render.snapshots = 0;
+	pthread_mutex_init(&(render.lock), NULL);
+	pthread_cond_init(&(render.wake), NULL);
+	pthread_cond_init(&(render.done), NULL);
+	pthread_mutex_lock(&(render.lock));
+	/* signals are left to the event loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	if (pthread_create(&(render.thread), NULL, renderer, p) == 0)
+		render.threaded = true;
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (!render.threaded) {
+		/* draw from the event loop as before */
+		pthread_mutex_unlock(&(render.lock));
+		pthread_cond_destroy(&(render.done));
+		pthread_cond_destroy(&(render.wake));
+		pthread_mutex_destroy(&(render.lock));
+	}
+#else
+	UNUSED_VARIABLE(p);
+#endif
+}
+
+void vterm_stopRenderer(TVterm *p)
+{
+	UNUSED_VARIABLE(p);
+#ifdef HAVE_LIBPTHREAD
+	if (render.threaded) {
+		/* exit() from the renderer itself; leave it to the process */
+		if (pthread_equal(pthread_self(), render.thread))
+			return;
+		render.quit = true;
+		pthread_cond_signal(&(render.wake));
+		pthread_mutex_unlock(&(render.lock));
+		pthread_join(render.thread, NULL);
+		render.threaded = false;
+		pthread_cond_destroy(&(render.done));
+		pthread_cond_destroy(&(render.wake));
+		pthread_mutex_destroy(&(render.lock));
+	}
+	stopBands();
+#endif
+	freeSnapshot();
+}
+
+/* the event loop gives the vterm up to the renderer while it sleeps */
+void vterm_lock(TVterm *p)
+{
+	UNUSED_VARIABLE(p);
+#ifdef HAVE_LIBPTHREAD
+	if (render.threaded)
+		pthread_mutex_lock(&(render.lock));
+#endif
+}
+
+void vterm_unlock(TVterm *p)
+{
+	UNUSED_VARIABLE(p);
+#ifdef HAVE_LIBPTHREAD
+	if (render.threaded)
+		pthread_mutex_unlock(&(render.lock));
+#endif
 }
 
 void vterm_sput(TVterm *p, u_int fontIndex, u_char c, u_char raw)
@@ -553,59 +1158,211 @@ void vterm_scroll_backward_page(TVterm *p)
 	}
 }
 
-void vterm_reverseText(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey)
+static void saveScreen(TVterm *p, TScreen *s)
+{
+	s->history = p->history;
+	s->historyTop = p->historyTop;
+	s->tsize = p->tsize;
+	s->text = p->text;
+	s->fontIndex = p->fontIndex;
+	s->rawText = p->rawText;
+	s->foreground = p->foreground;
+	s->background = p->background;
+	s->flag = p->flag;
+}
+
+static void loadScreen(TVterm *p, TScreen *s)
+{
+	p->history = s->history;
+	p->historyTop = s->historyTop;
+	p->tsize = s->tsize;
+	p->text = s->text;
+	p->fontIndex = s->fontIndex;
+	p->rawText = s->rawText;
+	p->foreground = s->foreground;
+	p->background = s->background;
+	p->flag = s->flag;
+}
+
+/*
+ * Show the alternate screen or the normal one.  The cells are swapped
+ * with those put aside, so the history of the normal screen is kept and
+ * nothing need be redrawn but the screen itself.
+ */
+void vterm_switchScreen(TVterm *p, bool alternate)
+{
+	TScreen screen;
+
+	if (p->altScreen == alternate)
+		return;
+	p->top = 0;
+	p->selection.active = false;
+	saveScreen(p, &screen);
+	loadScreen(p, &(p->other));
+	p->other = screen;
+	p->altScreen = alternate;
+	vterm_unclean(p);
+}
+
+static void reverseColors(uint8_t *foreground, uint8_t *background)
 {
-	u_int from, to, x, y, xx;
-	uint8_t foreground, background;
 	uint8_t foreground2, background2;
 
-	adjustCoordH(p, &sx, &sy);
-	adjustCoordH(p, &ex, &ey);
-	for (xx = p->cols, y = sy; y <= ey; y++) {
-		if (y == ey)
-			xx = ex;
-		from = coordToIndexH(p, sx, y);
-		to = coordToIndexH(p, xx, y);
-		if (p->flag[from] & VTERM_FLAG_2COLUMN_2)
-			from--;
-		for (x = from; x <= to; x++) {
-			if (p->rawText[x] == 0)
-				continue;
-			foreground = p->foreground[x];
-			background = p->background[x];
 #ifdef ENABLE_256_COLOR
-			if (foreground < 16 && background < 16) {
-				foreground2 = (foreground & 8) |
-					      (background & ~8);
-				background2 = (background & 8) |
-					      (foreground & ~8);
-				p->foreground[x] = foreground2;
-				p->background[x] = background2;
-			} else {
-				p->foreground[x] = background;
-				p->background[x] = foreground;
-			}
-#else
-			foreground2 = (foreground & 8) |
-				      (background & ~8);
-			background2 = (background & 8) |
-				      (foreground & ~8);
-			p->foreground[x] = foreground2;
-			p->background[x] = background2;
+	if (*foreground >= 16 || *background >= 16) {
+		foreground2 = *background;
+		*background = *foreground;
+		*foreground = foreground2;
+		return;
+	}
 #endif
-			p->flag[x] &= ~VTERM_FLAG_CLEAN;
+	foreground2 = (*foreground & 8) | (*background & ~8);
+	background2 = (*background & 8) | (*foreground & ~8);
+	*foreground = foreground2;
+	*background = background2;
+}
+
+/* the columns of row y which s selects, if any */
+static bool getSelectionSpan(TVterm *p, TSelection *s, u_int y,
+			     u_int *from, u_int *to)
+{
+	if (!s->active || y < s->sy || y > s->ey)
+		return false;
+	*from = (y == s->sy) ? s->sx : 0;
+	*to = (y == s->ey) ? s->ex : p->cols - 1;
+	return *from <= *to;
+}
+
+/* whether the cell at index i, (x, y) on the screen, is drawn reversed */
+static bool isSelected(TVterm *p, u_int i, u_int x, u_int y)
+{
+	u_int from, to;
+
+	if (p->rawText[i] == 0)
+		return false;
+	if (!getSelectionSpan(p, &(p->selection), y, &from, &to))
+		return false;
+	return x >= from && x <= to;
+}
+
+/* mark dirty the cells of the rows whose selection changed from old */
+static void uncleanSelection(TVterm *p, TSelection *old)
+{
+	u_int x, y, top, bottom, from, to, from2, to2;
+	bool selected, selected2;
+
+	if (!old->active && !p->selection.active)
+		return;
+	top = p->rows;
+	bottom = 0;
+	if (old->active) {
+		top = old->sy;
+		bottom = old->ey;
+	}
+	if (p->selection.active) {
+		if (p->selection.sy < top)
+			top = p->selection.sy;
+		if (p->selection.ey > bottom)
+			bottom = p->selection.ey;
+	}
+	if (bottom >= p->rows)
+		bottom = p->rows - 1;
+	for (y = top; y <= bottom; y++) {
+		selected = getSelectionSpan(p, old, y, &from, &to);
+		selected2 = getSelectionSpan(p, &(p->selection), y,
+					     &from2, &to2);
+		if (selected == selected2 &&
+		    (!selected || (from == from2 && to == to2)))
+			continue;
+		if (!selected) {
+			from = from2;
+			to = to2;
+		} else if (selected2) {
+			if (from2 < from)
+				from = from2;
+			if (to2 > to)
+				to = to2;
 		}
-		sx = 0;
+		if (to >= p->cols)
+			to = p->cols - 1;
+		if (isTailCharH(p, from, y))
+			from--;
+		for (x = from; x <= to; x++)
+			p->flag[coordToIndexH(p, x, y)] &= ~VTERM_FLAG_CLEAN;
 	}
 }
 
-void vterm_copyText(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey)
+/*
+ * Select from (sx, sy) to (ex, ey) on the screen.  The selection is drawn
+ * over the cells, and only the rows where it changed are drawn again.
+ */
+void vterm_setSelection(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey)
 {
-	u_int from, to, x, y, xx;
-	uint16_t rawText;
-	size_t nbytes;
-	iconv_t mbcd, uccd;
-	char inbytes[MAX_MULTIBYTE_LEN], outbytes[MAX_MULTIBYTE_LEN];
+	TSelection old;
+
+	adjustCoordH(p, &sx, &sy);
+	adjustCoordH(p, &ex, &ey);
+	old = p->selection;
+	p->selection.active = true;
+	p->selection.sx = sx;
+	p->selection.sy = sy;
+	p->selection.ex = ex;
+	p->selection.ey = ey;
+	uncleanSelection(p, &old);
+}
+
+void vterm_clearSelection(TVterm *p)
+{
+	TSelection old;
+
+	old = p->selection;
+	p->selection.active = false;
+	uncleanSelection(p, &old);
+}
+
+static void copyCode(COPY_MODE mode, uint16_t code)
+{
+	char *buf;
+
+	if (mode != copy.mode)
+		flushCopy();
+	copy.mode = mode;
+	if (copy.length + 3 > copy.size) {
+		buf = realloc(copy.buf, copy.size * 2 + COPY_BUF_SIZE);
+		if (buf == NULL)
+			err(1, "realloc()");
+		copy.buf = buf;
+		copy.size = copy.size * 2 + COPY_BUF_SIZE;
+	}
+	switch (mode) {
+	case COPY_TEXT:
+		copy.buf[copy.length++] = code & 0xff;
+		break;
+	case COPY_UTF8:
+		if (code < 0x80)
+			copy.buf[copy.length++] = code;
+		else if (code < 0x800) {
+			copy.buf[copy.length++] = 0xc0 | (code >> 6);
+			copy.buf[copy.length++] = 0x80 | (code & 0x3f);
+		} else if (code >= 0xd800 && code < 0xe000)
+			copy.buf[copy.length++] = 0x20; /* lone surrogate */
+		else {
+			copy.buf[copy.length++] = 0xe0 | (code >> 12);
+			copy.buf[copy.length++] = 0x80 | ((code >> 6) & 0x3f);
+			copy.buf[copy.length++] = 0x80 | (code & 0x3f);
+		}
+		break;
+	default:
+		copy.buf[copy.length++] = (code >> 8) & 0xff;
+		copy.buf[copy.length++] = code & 0xff;
+		break;
+	}
+}
+
+/* convert the run gathered by copyCode() into the clipboard */
+static void flushCopy(void)
+{
+	char outbytes[COPY_BUF_SIZE];
 #if defined (__GLIBC__)
 	char *inbuf;
 #else
@@ -613,22 +1370,76 @@ void vterm_copyText(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey)
 #endif
 	char *outbuf;
 	size_t inbytesleft, outbytesleft;
+	iconv_t cd;
+
+	if (copy.length == 0)
+		return;
+	if (copy.mode == COPY_TEXT || copy.mode == COPY_UTF8) {
+		clipboard_appendText(copy.buf, copy.length);
+		copy.length = 0;
+		return;
+	}
+	cd = (copy.mode == COPY_MULTIBYTE) ? copy.mbcd : copy.uccd;
+	inbuf = copy.buf;
+	inbytesleft = copy.length;
+	while (inbytesleft > 0) {
+		outbuf = outbytes;
+		outbytesleft = sizeof(outbytes);
+		if (iconv(cd, &inbuf, &inbytesleft,
+			  &outbuf, &outbytesleft) == (size_t)-1 &&
+		    errno != E2BIG) {
+			/* a code which does not convert is copied as a space */
+			if (outbytesleft == 0) {
+				clipboard_appendText(outbytes,
+						     sizeof(outbytes));
+				outbuf = outbytes;
+				outbytesleft = sizeof(outbytes);
+			}
+			*outbuf++ = 0x20;
+			outbytesleft--;
+			inbuf += 2;
+			inbytesleft = (inbytesleft > 2) ? inbytesleft - 2 : 0;
+		}
+		clipboard_appendText(outbytes, sizeof(outbytes) - outbytesleft);
+	}
+	outbuf = outbytes;
+	outbytesleft = sizeof(outbytes);
+	iconv(cd, NULL, NULL, &outbuf, &outbytesleft);
+	clipboard_appendText(outbytes, sizeof(outbytes) - outbytesleft);
+	copy.length = 0;
+}
+
+/*
+ * Copy the text from (sx, sy) to (ex, ey) on the screen to the clipboard.
+ * Cells are gathered into runs which convert alike, and each run is
+ * converted by one iconv() call; UCS-2 is encoded to UTF-8 here.
+ */
+void vterm_copyText(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey)
+{
+	u_int from, to, x, y, xx;
+	uint16_t rawText;
+	COPY_MODE unicode;
 
 	clipboard_clear();
 
-	mbcd = (iconv_t)-1;
-	uccd = (iconv_t)-1;
+	copy.mode = COPY_TEXT;
+	copy.length = 0;
+	copy.mbcd = (iconv_t)-1;
+	copy.uccd = (iconv_t)-1;
+	unicode = COPY_TEXT;
 #ifdef ENABLE_OTHER_CODING_SYSTEM
 	if (vterm_is_otherCS(p)) {
 		if (strcasecmp(p->otherCS->fromcode, p->otherCS->tocode) != 0)
-			mbcd = iconv_open(p->otherCS->fromcode,
-					  p->otherCS->tocode);
-		uccd = iconv_open(p->otherCS->fromcode, "UCS-2BE");
+			copy.mbcd = iconv_open(p->otherCS->fromcode,
+					       p->otherCS->tocode);
+		copy.uccd = iconv_open(p->otherCS->fromcode, "UCS-2BE");
+		if (copy.uccd != (iconv_t)-1)
+			unicode = COPY_UNICODE;
 	}
 #endif
 #ifdef ENABLE_UTF8
-	if (uccd == (iconv_t)-1 && vterm_is_UTF8(p))
-		uccd = iconv_open("UTF-8", "UCS-2BE");
+	if (unicode == COPY_TEXT && vterm_is_UTF8(p))
+		unicode = COPY_UTF8;
 #endif
 
 	adjustCoordH(p, &sx, &sy);
@@ -646,76 +1457,76 @@ void vterm_copyText(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey)
 		to = x;
 		for (x = from; x <= to; x++) {
 			rawText = p->rawText[x];
-			outbytes[0] = 0x20;
-			nbytes = 1;
+			if (p->flag[x] & VTERM_FLAG_2COLUMN_2)
+				continue;
 			if (p->flag[x] & VTERM_FLAG_1COLUMN &&
 			    p->flag[x] & VTERM_FLAG_MULTIBYTE) {
-				outbytes[0] = rawText & 0xff;
-				nbytes = 1;
+				rawText &= 0xff;
+				if (rawText < 0x20 || rawText == 0x7f)
+					rawText = 0x20;
+				copyCode(COPY_TEXT, rawText);
 			} else if (p->flag[x] & VTERM_FLAG_2COLUMN_1 &&
 				   p->flag[x] & VTERM_FLAG_MULTIBYTE) {
-				if (mbcd != (iconv_t)-1) {
-					inbytes[0] = (rawText >> 8) & 0xff;
-					inbytes[1] = rawText & 0xff;
-					inbuf = inbytes;
-					inbytesleft = 2;
-					outbuf = outbytes;
-					outbytesleft = sizeof(outbytes);
-					if (iconv(mbcd, &inbuf, &inbytesleft,
-						  &outbuf, &outbytesleft) != -1)
-						nbytes = sizeof(outbytes) -
-							 outbytesleft;
-					else {
-						outbytes[0] = 0x20;
-						nbytes = 1;
-					}
-				} else {
-					outbytes[0] = (rawText >> 8) & 0xff;
-					outbytes[1] = rawText & 0xff;
-					nbytes = 2;
+				if (copy.mbcd != (iconv_t)-1)
+					copyCode(COPY_MULTIBYTE, rawText);
+				else {
+					copyCode(COPY_TEXT, rawText >> 8);
+					copyCode(COPY_TEXT, rawText);
 				}
-			} else if ((p->flag[x] & VTERM_FLAG_1COLUMN &&
-				    p->flag[x] & VTERM_FLAG_UNICODE) ||
-				   (p->flag[x] & VTERM_FLAG_2COLUMN_1 &&
-				    p->flag[x] & VTERM_FLAG_UNICODE)) {
-				if (uccd != (iconv_t)-1) {
-					inbytes[0] = (rawText >> 8) & 0xff;
-					inbytes[1] = rawText & 0xff;
-					inbuf = inbytes;
-					inbytesleft = 2;
-					outbuf = outbytes;
-					outbytesleft = sizeof(outbytes);
-					if (iconv(uccd, &inbuf, &inbytesleft,
-						  &outbuf, &outbytesleft) != -1)
-						nbytes = sizeof(outbytes) -
-							 outbytesleft;
-					else {
-						outbytes[0] = 0x20;
-						nbytes = 1;
-					}
-				}
-			} else if (p->flag[x] & VTERM_FLAG_2COLUMN_2)
-				continue;
-			if (nbytes == 1 &&
-			    (outbytes[0] < 0x20 || outbytes[0] == 0x7f))
-				outbytes[0] = 0x20;
-			clipboard_appendText(outbytes, nbytes);
+			} else if ((p->flag[x] & VTERM_FLAG_1COLUMN ||
+				    p->flag[x] & VTERM_FLAG_2COLUMN_1) &&
+				   p->flag[x] & VTERM_FLAG_UNICODE &&
+				   unicode != COPY_TEXT) {
+				if (rawText < 0x20 || rawText == 0x7f)
+					copyCode(COPY_TEXT, 0x20);
+				else
+					copyCode(unicode, rawText);
+			} else
+				copyCode(COPY_TEXT, 0x20);
 		}
 		if (y < ey)
-			clipboard_appendText("\n", 1);
+			copyCode(COPY_TEXT, '\n');
 		sx = 0;
 	}
-	if (mbcd != (iconv_t)-1)
-		iconv_close(mbcd);
-	if (uccd != (iconv_t)-1)
-		iconv_close(uccd);
+	flushCopy();
+	if (copy.mbcd != (iconv_t)-1)
+		iconv_close(copy.mbcd);
+	if (copy.uccd != (iconv_t)-1)
+		iconv_close(copy.uccd);
 }
 
+#define PASTE_START "\033[200~"
+#define PASTE_END   "\033[201~"
+
+/*
+ * Queue the clipboard for the pty.  In bracketed paste mode the text is
+ * wrapped in PASTE_START/PASTE_END, and any PASTE_END inside it is left
+ * out so the paste cannot end early.
+ */
 void vterm_pasteText(TVterm *p)
 {
-	if (clipboard_getLength() > 1)
-		write_wrapper(p->term->masterPty,
-		              clipboard_getText(), clipboard_getLength() - 1);
+	const char *text, *s;
+	size_t length, n;
+
+	if (clipboard_getLength() <= 1)
+		return;
+	text = clipboard_getText();
+	length = clipboard_getLength() - 1;
+	if (!p->bracketedPaste) {
+		term_paste(text, length);
+		return;
+	}
+	n = strlen(PASTE_END);
+	term_paste(PASTE_START, strlen(PASTE_START));
+	for (s = text; s + n <= text + length; s++) {
+		if (memcmp(s, PASTE_END, n) == 0) {
+			term_paste(text, s - text);
+			text = s + n;
+			s += n - 1;
+		}
+	}
+	term_paste(text, length - (text - clipboard_getText()));
+	term_paste(PASTE_END, n);
 }
 
 static void pollMouseCursor(TVterm *p)
@@ -733,6 +1544,7 @@ static void pollMouseCursor(TVterm *p)
 		mouseCursor.x = x;
 		mouseCursor.y = y;
 		mouseCursor.wide = wide;
+		getCell(p, x, y, &(mouseCursor.under));
 		cursor_show(p, &mouseCursor, true);
 	} else {
 		if (mouse_isTimeout())
@@ -748,7 +1560,23 @@ static void pollMouseCursor(TVterm *p)
 	}
 }
 
+static inline int minTimeout(int timeout, int next)
+{
+	return (timeout == -1 || next < timeout) ? next : timeout;
+}
+
+/* the cursors are shared with the renderer, so keep it out meanwhile */
 void vterm_pollCursor(TVterm *p, bool wakeup)
+{
+	/* an update whose end never came is drawn as it stands */
+	if (p->syncUpdate && getSyncTimeout(p) == 0)
+		vterm_requestRefresh(p);
+	framebuffer_lock();
+	pollCursor(p, wakeup);
+	framebuffer_unlock();
+}
+
+static void pollCursor(TVterm *p, bool wakeup)
 {
 	static bool scrollLocked[2];
 
@@ -783,3 +1611,30 @@ void vterm_pollCursor(TVterm *p, bool wakeup)
 		pollMouseCursor(p);
 }
 
+/*
+ * msec. until vterm_pollCursor() has idle work to do, or -1 if it has
+ * none, so that an idle console need not wake up.
+ */
+int vterm_getPollTimeout(TVterm *p)
+{
+	int timeout;
+
+	if (!p->active || screensaver_isRunning())
+		return -1;
+	timeout = getSyncTimeout(p);
+	if (screensaver_isEnable())
+		timeout = minTimeout(timeout, screensaver_getTimeout());
+	if (cursor.style == CURSOR_STYLE_BLINK)
+		timeout = minTimeout(timeout, cursor_getTimeout(&cursor));
+	if (mouse_isEnable()) {
+		if (!mouse_isTimeout()) {
+			timeout = minTimeout(timeout, mouse_getTimeout());
+			if (mouseCursor.style == CURSOR_STYLE_BLINK)
+				timeout = minTimeout(timeout,
+					cursor_getTimeout(&mouseCursor));
+		} else if (mouseCursor.shown)
+			timeout = 0;
+	}
+	return timeout;
+}
+
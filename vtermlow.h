@@ -46,6 +46,12 @@ void vterm_unclean(TVterm *p);
 void vterm_delete_n_chars(TVterm *p, int n);
 void vterm_insert_n_chars(TVterm *p, int n);
 void vterm_refresh(TVterm *p);
+void vterm_requestRefresh(TVterm *p);
+void vterm_setSyncUpdate(TVterm *p, bool flag);
+void vterm_startRenderer(TVterm *p);
+void vterm_stopRenderer(TVterm *p);
+void vterm_lock(TVterm *p);
+void vterm_unlock(TVterm *p);
 void vterm_sput(TVterm *p, u_int fontIndex, u_char c, u_char raw);
 void vterm_wput(TVterm *p, u_int fontIndex, u_char c1, u_char c2, u_char raw1, u_char raw2);
 #ifdef ENABLE_UTF8
@@ -64,10 +70,13 @@ void vterm_scroll_forward_line(TVterm *p);
 void vterm_scroll_backward_line(TVterm *p);
 void vterm_scroll_forward_page(TVterm *p);
 void vterm_scroll_backward_page(TVterm *p);
-void vterm_reverseText(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey);
+void vterm_switchScreen(TVterm *p, bool alternate);
+void vterm_setSelection(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey);
+void vterm_clearSelection(TVterm *p);
 void vterm_copyText(TVterm *p, u_int sx, u_int sy, u_int ex, u_int ey);
 void vterm_pasteText(TVterm *p);
 void vterm_pollCursor(TVterm *p, bool wakeup);
+int vterm_getPollTimeout(TVterm *p);
 
 #endif /* INCLUDE_VTERMLOW_H */
 